@@ -0,0 +1,580 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../test/mock_s3.h"
+
+#include "common/checksum.h"
+#include "common/delta.h"
+#include "common/replicas.h"
+#include "common/xattr.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+/**
+ * The settings for a single benchmark run, as given on the command line.
+ */
+struct bench_opts {
+
+    /**
+     * The scratch directory in which the synthetic share is generated. This
+     * must live on a filesystem that supports user extended attributes.
+     */
+    string root;
+
+    /**
+     * The number of small "Office" documents to generate.
+     */
+    long small_files = 10000;
+
+    /**
+     * The number of large, sparse media and disk image files to generate.
+     */
+    long large_files = 4;
+
+    /**
+     * The size, in bytes, of each large file.
+     */
+    off_t large_size = (off_t) 4 << 30;
+
+    /**
+     * The depth of the generated directory tree.
+     */
+    int depth = 8;
+
+    /**
+     * The number of files placed in each leaf directory before a new branch
+     * of the tree is started.
+     */
+    int fanout = 64;
+
+    /**
+     * The seed for the pseudo-random generator, so that runs are repeatable.
+     */
+    unsigned int seed = 1;
+
+    /**
+     * The number of small files uploaded to, and recalled from, the mock S3
+     * replicas.
+     */
+    long upload_files = 1000;
+
+    /**
+     * The time, in milliseconds, that each request to a mock replica takes to
+     * answer.
+     */
+    int latency_ms = 0;
+
+    /**
+     * The bandwidth, in bytes per second, of each mock replica. Zero is
+     * unlimited.
+     */
+    long bandwidth = 0;
+
+    /**
+     * The percentage of requests to each mock replica that fail.
+     */
+    int error_rate = 0;
+
+};
+
+/**
+ * The number of files visited by the scan benchmark, which nftw() has no
+ * way to pass through to the callback.
+ */
+static long scan_files = 0;
+
+/**
+ * The number of stub or dirty files found by the scan benchmark.
+ */
+static long scan_hits = 0;
+
+/**
+ * Returns the current value of the monotonic clock in nanoseconds.
+ *
+ * @return
+ *     The current monotonic time, in nanoseconds.
+ */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Print the result of a single benchmark as one line of JSON, including the
+ * latency percentiles of the recorded samples. The samples are sorted in
+ * place.
+ *
+ * @param name
+ *     The name of the benchmark.
+ *
+ * @param samples
+ *     The latency of each individual operation, in nanoseconds.
+ *
+ * @param total_ns
+ *     The wall clock time taken by the whole benchmark, in nanoseconds.
+ *
+ * @param bytes
+ *     The number of bytes processed by the whole benchmark, if the
+ *     benchmark measures throughput, or zero if it does not.
+ *
+ * @param extra
+ *     Any further fields of the result, each preceded by a comma.
+ */
+static void report(const char* name, vector<uint64_t>& samples,
+        uint64_t total_ns, uint64_t bytes = 0, const string& extra = "") {
+    sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    auto pct = [&](double p) -> uint64_t {
+        return n ? samples[min(n - 1, (size_t) (p * n))] : 0;
+    };
+    string throughput;
+    if (bytes) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), ",\"bytes\":%llu,\"bytes_per_sec\":%.1f",
+                (unsigned long long) bytes,
+                total_ns ? bytes * 1e9 / total_ns : 0.0);
+        throughput = buf;
+    }
+    printf("{\"bench\":\"%s\",\"ops\":%zu,\"total_ns\":%llu,"
+            "\"ops_per_sec\":%.1f%s,\"p50_ns\":%llu,\"p90_ns\":%llu,"
+            "\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu%s}\n",
+            name, n, (unsigned long long) total_ns,
+            total_ns ? n * 1e9 / total_ns : 0.0, throughput.c_str(),
+            (unsigned long long) pct(0.50), (unsigned long long) pct(0.90),
+            (unsigned long long) pct(0.99), (unsigned long long) pct(0.999),
+            (unsigned long long) (n ? samples[n - 1] : 0), extra.c_str());
+    fflush(stdout);
+}
+
+/**
+ * Build the path of the directory that holds the given file number, so that
+ * files are spread across a tree of the configured depth.
+ *
+ * @param opts
+ *     The benchmark settings.
+ *
+ * @param file
+ *     The sequence number of the file.
+ *
+ * @return
+ *     The path of the directory that holds the file.
+ */
+static string tree_dir(const bench_opts& opts, long file) {
+    string dir = opts.root + "/share";
+    long branch = file / opts.fanout;
+    for (int level = 0; level < opts.depth; level++) {
+        dir += "/d" + to_string(branch % 16);
+        branch /= 16;
+    }
+    return dir;
+}
+
+/**
+ * Create the given directory and any missing parents.
+ *
+ * @param dir
+ *     The directory to create.
+ *
+ * @return
+ *     Zero on success, or -1 if a directory could not be created.
+ */
+static int make_dirs(const string& dir) {
+    for (size_t pos = 1; pos != string::npos; ) {
+        pos = dir.find('/', pos + 1);
+        string part = dir.substr(0, pos);
+        if (mkdir(part.c_str(), 0755) != 0 && errno != EEXIST)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Generate the synthetic share: a deep tree of small Office documents with
+ * random contents, and a handful of large sparse media files and disk images
+ * with a few written extents, as commonly found on a Windows file server.
+ *
+ * @param opts
+ *     The benchmark settings.
+ *
+ * @param paths
+ *     The vector that receives the path of every small file generated.
+ *
+ * @return
+ *     Zero on success, or -1 if the share could not be generated.
+ */
+static int generate(const bench_opts& opts, vector<string>& paths) {
+    static const char* exts[] = { "docx", "xlsx", "pptx", "pdf", "msg" };
+    vector<char> buf(256 * 1024);
+    vector<uint64_t> samples;
+    samples.reserve(opts.small_files);
+
+    uint64_t start = now_ns();
+    for (long i = 0; i < opts.small_files; i++) {
+        string dir = tree_dir(opts, i);
+        if (i % opts.fanout == 0 && make_dirs(dir) != 0) {
+            perror(dir.c_str());
+            return -1;
+        }
+        string path = dir + "/f" + to_string(i) + "." + exts[i % 5];
+
+        /* Office documents are mostly between 4 KiB and 256 KiB. */
+        size_t size = 4096 + rand() % (buf.size() - 4096);
+        for (size_t j = 0; j < size; j += sizeof(int))
+            *(int*) &buf[j] = rand();
+
+        uint64_t op = now_ns();
+        int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (fd < 0 || write(fd, buf.data(), size) != (ssize_t) size) {
+            perror(path.c_str());
+            return -1;
+        }
+        close(fd);
+        samples.push_back(now_ns() - op);
+        paths.push_back(path);
+    }
+    report("generate.small", samples, now_ns() - start);
+
+    string media = opts.root + "/share/media";
+    if (make_dirs(media) != 0) {
+        perror(media.c_str());
+        return -1;
+    }
+    samples.clear();
+    start = now_ns();
+    for (long i = 0; i < opts.large_files; i++) {
+        string path = media + "/m" + to_string(i) + (i % 2 ? ".vhdx" : ".mp4");
+        uint64_t op = now_ns();
+        int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (fd < 0 || ftruncate(fd, opts.large_size) != 0) {
+            perror(path.c_str());
+            return -1;
+        }
+
+        /* Write a few extents so that the file is only partially sparse. */
+        for (int j = 0; j < 16; j++) {
+            off_t offset = (opts.large_size / 16) * j;
+            if (pwrite(fd, buf.data(), buf.size(), offset) < 0)
+                perror(path.c_str());
+        }
+        close(fd);
+        samples.push_back(now_ns() - op);
+    }
+    report("generate.large", samples, now_ns() - start);
+
+    return 0;
+}
+
+/**
+ * Benchmark a single HSM xattr operation against every generated file.
+ *
+ * @param name
+ *     The name of the benchmark.
+ *
+ * @param paths
+ *     The files the operation is run against.
+ *
+ * @param op
+ *     The HSM xattr operation to benchmark.
+ */
+template <typename Op>
+static void bench_xattr(const char* name, const vector<string>& paths, Op op) {
+    vector<uint64_t> samples;
+    samples.reserve(paths.size());
+    uint64_t start = now_ns();
+    for (const string& path : paths) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            continue;
+        uint64_t t = now_ns();
+        op(fd);
+        samples.push_back(now_ns() - t);
+        close(fd);
+    }
+    report(name, samples, now_ns() - start);
+}
+
+/**
+ * Benchmark the block checksums used by delta sync, computing the weak and
+ * strong checksum of every block of a buffer of random data, and rolling the
+ * weak checksum through every block one byte at a time.
+ *
+ * @param size
+ *     The size of the buffer, in bytes.
+ */
+static void bench_delta(size_t size) {
+    vector<uint8_t> data(size + DELTA_BLOCK_SIZE);
+    for (uint8_t& byte : data)
+        byte = (uint8_t) rand();
+
+    vector<uint64_t> weak_samples;
+    vector<uint64_t> strong_samples;
+    uint64_t weak_total = 0;
+    uint64_t strong_total = 0;
+    volatile uint64_t sink = 0;
+    for (size_t offset = 0; offset < size; offset += DELTA_BLOCK_SIZE) {
+        uint64_t t = now_ns();
+        sink += delta_weak(&data[offset], DELTA_BLOCK_SIZE);
+        uint64_t weak = now_ns() - t;
+        t = now_ns();
+        sink += delta_strong(&data[offset], DELTA_BLOCK_SIZE);
+        uint64_t strong = now_ns() - t;
+        weak_samples.push_back(weak);
+        strong_samples.push_back(strong);
+        weak_total += weak;
+        strong_total += strong;
+    }
+    report("delta.weak_block", weak_samples, weak_total, size);
+    report("delta.strong_block", strong_samples, strong_total, size);
+
+    vector<uint64_t> samples;
+    uint64_t roll_total = 0;
+    uint32_t weak = delta_weak(&data[0], DELTA_BLOCK_SIZE);
+    for (size_t offset = 0; offset < size; offset += DELTA_BLOCK_SIZE) {
+        uint64_t t = now_ns();
+        for (size_t i = offset; i < offset + DELTA_BLOCK_SIZE; i++)
+            weak = delta_roll(weak, DELTA_BLOCK_SIZE, data[i],
+                    data[i + DELTA_BLOCK_SIZE]);
+        uint64_t roll = now_ns() - t;
+        samples.push_back(roll);
+        roll_total += roll;
+    }
+    sink += weak;
+    report("delta.roll_block", samples, roll_total, size);
+}
+
+/**
+ * Benchmark replication through a pair of mock S3 replicas with the
+ * configured latency, bandwidth and error rate, uploading some of the
+ * generated files to both and then recalling them. A file that fails to
+ * reach every replica is retried, as the offload program would, and its
+ * sample covers every attempt.
+ *
+ * @param opts
+ *     The benchmark settings.
+ *
+ * @param paths
+ *     The generated files, of which the first upload_files are used.
+ *
+ * @return
+ *     Zero on success, or -1 if the mock replicas could not be created.
+ */
+static int bench_replicas(const bench_opts& opts,
+        const vector<string>& paths) {
+    vector<s3> targets;
+    for (const char* name : { "a", "b" }) {
+        string endpoint = opts.root + "/s3/" + name;
+        if (make_dirs(endpoint) != 0) {
+            perror(endpoint.c_str());
+            return -1;
+        }
+        s3 target("bench", "");
+        target.set_endpoint(endpoint);
+        mock_endpoint& e = mock_s3(endpoint);
+        e.delay_ms = opts.latency_ms;
+        e.bandwidth = opts.bandwidth;
+        e.error_rate = opts.error_rate;
+        targets.push_back(target);
+    }
+    replicas set(targets);
+    size_t count = min(paths.size(), (size_t) max(0l, opts.upload_files));
+
+    vector<uint64_t> samples;
+    uint64_t bytes = 0;
+    long retries = 0;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        int fd = open(paths[i].c_str(), O_RDWR);
+        if (fd < 0)
+            continue;
+        /* The xattr benchmarks leave every file marked as a stub, though
+         * its data is still in place. */
+        hsm_clear_stub(fd);
+        hsm_mark_dirty(fd);
+        if (hsm_set_id(fd) < 0) {
+            close(fd);
+            continue;
+        }
+        uint64_t gen = hsm_get_generation(fd);
+        uint64_t t = now_ns();
+        ssize_t sent;
+        for (int attempt = 0; (sent = set.upload_file(fd, fd, gen)) < 0
+                && attempt < 10; attempt++)
+            retries++;
+        samples.push_back(now_ns() - t);
+        if (sent > 0)
+            bytes += sent;
+        close(fd);
+    }
+    report("replicas.upload", samples, now_ns() - start, bytes,
+            ",\"retries\":" + to_string(retries));
+
+    samples.clear();
+    bytes = 0;
+    retries = 0;
+    start = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        int fd = open(paths[i].c_str(), O_RDWR);
+        if (fd < 0)
+            continue;
+        uint64_t t = now_ns();
+        ssize_t got;
+        for (int attempt = 0; (got = set.download_file(fd)) < 0
+                && attempt < 10; attempt++)
+            retries++;
+        samples.push_back(now_ns() - t);
+        if (got > 0)
+            bytes += got;
+        close(fd);
+    }
+    report("replicas.download", samples, now_ns() - start, bytes,
+            ",\"retries\":" + to_string(retries));
+    return 0;
+}
+
+/**
+ * The nftw() callback for the scan benchmark, which checks the HSM flags of
+ * each regular file in the same manner as the offload program.
+ */
+static int scan_file(const char* path, const struct stat* sb, int type,
+        struct FTW*) {
+    if (type != FTW_F || !S_ISREG(sb->st_mode))
+        return 0;
+    int fd = open(path, O_RDONLY | O_NOATIME);
+    if (fd < 0)
+        fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    scan_files++;
+    if (hsm_is_stub(fd) || hsm_is_dirty(fd))
+        scan_hits++;
+    close(fd);
+    return 0;
+}
+
+/**
+ * Print the usage of the benchmark program.
+ *
+ * @param prog
+ *     The name of the program, as invoked.
+ */
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-n small-files] [-l large-files] "
+            "[-s large-size-mb] [-d depth] [-f fanout] [-r seed] "
+            "[-u upload-files] [-L latency-ms] [-B bandwidth-mb] "
+            "[-E error-percent] scratch-dir\n", prog);
+}
+
+/**
+ * The CloudSM benchmark program, which generates a synthetic file share in a
+ * scratch directory and measures the performance of the HSM layer against it.
+ * Each benchmark is written to standard output as a single line of JSON so
+ * that results can be compared from one release to the next.
+ *
+ * @param argc
+ *     The number of arguments passed to the program.
+ *
+ * @param argv
+ *     The array of arguments passed to the program.
+ *
+ * @return
+ *     Zero if the benchmarks complete; non-zero if an error occurs.
+ */
+int main(int argc, char** argv) {
+
+    bench_opts opts;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:l:s:d:f:r:u:L:B:E:")) != -1) {
+        switch (opt) {
+            case 'n': opts.small_files = atol(optarg); break;
+            case 'l': opts.large_files = atol(optarg); break;
+            case 's': opts.large_size = (off_t) atol(optarg) << 20; break;
+            case 'd': opts.depth = atoi(optarg); break;
+            case 'f': opts.fanout = max(1, atoi(optarg)); break;
+            case 'r': opts.seed = (unsigned int) atoi(optarg); break;
+            case 'u': opts.upload_files = atol(optarg); break;
+            case 'L': opts.latency_ms = atoi(optarg); break;
+            case 'B': opts.bandwidth = atol(optarg) << 20; break;
+            case 'E': opts.error_rate = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    opts.root = argv[optind];
+    srand(opts.seed);
+
+    vector<string> paths;
+    if (generate(opts, paths) != 0)
+        return 1;
+
+    bench_xattr("xattr.is_stub.unset", paths,
+            [](int fd) { hsm_is_stub(fd); });
+    bench_xattr("xattr.mark_dirty", paths,
+            [](int fd) { hsm_mark_dirty(fd); });
+    bench_xattr("xattr.is_dirty", paths,
+            [](int fd) { hsm_is_dirty(fd); });
+    bench_xattr("xattr.clear_dirty", paths,
+            [](int fd) { hsm_clear_dirty(fd); });
+    bench_xattr("xattr.mark_stub", paths,
+            [](int fd) { hsm_mark_stub(fd); });
+
+    bench_delta((size_t) 256 << 20);
+    if (bench_replicas(opts, paths) != 0)
+        return 1;
+
+    /* The offload scan usually runs against cold metadata after a long idle
+     * period, but the dentry and inode caches can only be dropped as root.
+     * Otherwise the scan measures a warm cache, as reported by "cold". */
+    sync();
+    bool cold = false;
+    if (geteuid() == 0) {
+        int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+        if (fd >= 0) {
+            cold = write(fd, "3\n", 2) == 2;
+            close(fd);
+        }
+    }
+    uint64_t start = now_ns();
+    nftw((opts.root + "/share").c_str(), scan_file, 64, FTW_PHYS);
+    uint64_t total = now_ns() - start;
+    printf("{\"bench\":\"scan.offload\",\"cold\":%s,\"files\":%ld,"
+            "\"hits\":%ld,\"total_ns\":%llu,\"files_per_sec\":%.1f}\n",
+            cold ? "true" : "false", scan_files, scan_hits,
+            (unsigned long long) total,
+            total ? scan_files * 1e9 / total : 0.0);
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/checksum.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+uint32_t delta_weak(const uint8_t* data, size_t size) {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    /* For each 16 byte chunk c starting at offset 16c, the bytes contribute
+     * (size - 16c) * sum(chunk) - sum(k * x[16c + k]) to b. The first term is
+     * accumulated through a running total of the chunk sums. */
+    size_t chunks = size / 16;
+    if (chunks > 0) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i weights_lo = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m128i weights_hi = _mm_setr_epi16(8, 9, 10, 11, 12, 13, 14,
+                15);
+        __m128i sums = zero;
+        __m128i prefixes = zero;
+        __m128i weighted = zero;
+        for (size_t c = 0; c < chunks; c++) {
+            __m128i x = _mm_loadu_si128((const __m128i*) (data + 16 * c));
+            prefixes = _mm_add_epi32(prefixes, sums);
+            sums = _mm_add_epi32(sums, _mm_sad_epu8(x, zero));
+            weighted = _mm_add_epi32(weighted,
+                    _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), weights_lo));
+            weighted = _mm_add_epi32(weighted,
+                    _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), weights_hi));
+        }
+
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i*) lanes, sums);
+        uint32_t sum = lanes[0] + lanes[2];
+        _mm_storeu_si128((__m128i*) lanes, prefixes);
+        uint32_t prefix = lanes[0] + lanes[2];
+        _mm_storeu_si128((__m128i*) lanes, weighted);
+        uint32_t weight = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+        a = sum;
+        b = (uint32_t) size * sum
+                - 16 * ((uint32_t) (chunks - 1) * sum - prefix) - weight;
+        i = chunks * 16;
+    }
+#endif
+
+    for (; i < size; i++) {
+        a += data[i];
+        b += (uint32_t) (size - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+uint32_t delta_roll(uint32_t weak, size_t size, uint8_t out, uint8_t in) {
+    uint32_t a = weak & 0xffff;
+    uint32_t b = weak >> 16;
+    a = a - out + in;
+    b = b - (uint32_t) size * out + a;
+    return (a & 0xffff) | (b << 16);
+}
+
+uint64_t delta_strong(const uint8_t* data, size_t size) {
+    const uint64_t k1 = 0x9e3779b97f4a7c15ull;
+    const uint64_t k2 = 0xc2b2ae3d27d4eb4full;
+    uint64_t h = size * k1;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        w *= k2;
+        w = (w << 31) | (w >> 33);
+        h ^= w * k1;
+        h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+    }
+    for (; i < size; i++) {
+        h ^= data[i] * k1;
+        h = ((h << 11) | (h >> 53)) * k2;
+    }
+
+    /* Final avalanche, from SplitMix64. */
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return h;
+}
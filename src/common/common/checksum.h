@@ -0,0 +1,79 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compute the weak, rolling checksum of a block of data. This is the same
+ * checksum that rsync uses: the low 16 bits are the sum of the bytes and the
+ * high 16 bits are the sum of the bytes weighted by their distance from the
+ * end of the block, which allows the checksum to be rolled forward one byte
+ * at a time with delta_roll(). The initial checksum of a block is computed
+ * 16 bytes at a time with SSE2 where it is available.
+ *
+ * @param data
+ *     The data to compute the checksum of.
+ *
+ * @param size
+ *     The number of bytes of data.
+ *
+ * @return
+ *     The weak checksum of the data.
+ */
+uint32_t delta_weak(const uint8_t* data, size_t size);
+
+/**
+ * Roll a weak checksum forward by one byte, removing the first byte of the
+ * block and appending the byte following it.
+ *
+ * @param weak
+ *     The weak checksum of the block.
+ *
+ * @param size
+ *     The size of the block, in bytes.
+ *
+ * @param out
+ *     The first byte of the block, which is being removed.
+ *
+ * @param in
+ *     The byte following the block, which is being added.
+ *
+ * @return
+ *     The weak checksum of the block one byte further on.
+ */
+uint32_t delta_roll(uint32_t weak, size_t size, uint8_t out, uint8_t in);
+
+/**
+ * Compute the strong checksum of a block of data, used to confirm a match
+ * found with the weak checksum. This is a 64-bit hash that is fast and well
+ * mixed, but not cryptographic.
+ *
+ * @param data
+ *     The data to compute the checksum of.
+ *
+ * @param size
+ *     The number of bytes of data.
+ *
+ * @return
+ *     The strong checksum of the data.
+ */
+uint64_t delta_strong(const uint8_t* data, size_t size);
+
+#endif /* CHECKSUM_H */
@@ -0,0 +1,284 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "common/checksum.h"
+#include "common/s3.h"
+
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+using namespace std;
+
+/**
+ * The size, in bytes, of the blocks that files are divided into when looking
+ * for changes.
+ */
+#define DELTA_BLOCK_SIZE (64 * 1024)
+
+/**
+ * The number of patches that may be uploaded on top of a full copy of a file
+ * before the next upload is a full copy again.
+ */
+#define DELTA_MAX_PATCHES 16
+
+/**
+ * Running totals of the data handled by delta sync.
+ */
+struct delta_stats {
+
+    /**
+     * The total size, in bytes, of the files synchronized.
+     */
+    uint64_t total_bytes;
+
+    /**
+     * The number of bytes found to have changed since the last upload.
+     */
+    uint64_t changed_bytes;
+
+    /**
+     * The number of bytes actually uploaded, including full copies.
+     */
+    uint64_t uploaded_bytes;
+
+};
+
+/**
+ * Synchronizes modified files to the cloud by uploading only the blocks that
+ * have changed since the last upload, in the manner of rsync. The block
+ * signatures of the last uploaded version of each file are kept in a sidecar
+ * file in a catalog directory, named after the file's object ID, along with
+ * the entity tag of the full copy they were taken against. Changed blocks are
+ * uploaded as a patch object on top of the last full copy, and after
+ * DELTA_MAX_PATCHES patches, once the patches add up to half the size of the
+ * file, or once the full copy has been replaced by an upload made elsewhere,
+ * a full copy is uploaded again.
+ */
+class delta {
+public:
+
+    /**
+     * Constructor for delta sync using the given catalog directory.
+     *
+     * @param catalog
+     *     The directory that block signatures are kept in.
+     */
+    delta(string catalog);
+
+    /**
+     * Synchronize a modified file, uploading either a patch of the changed
+     * blocks or a full copy of the file.
+     *
+     * @param target
+     *     The S3 target holding the cloud copy of the file.
+     *
+     * @param fd
+     *     The file descriptor of the file being synchronized.
+     *
+     * @param source
+     *     The file descriptor that the file contents are read from.
+     *
+     * @return
+     *     The number of bytes uploaded, or -1 if an error occurs.
+     */
+    ssize_t sync(s3& target, int fd, int source);
+
+    /**
+     * Returns the running totals of the data handled so far.
+     *
+     * @return
+     *     The running totals.
+     */
+    delta_stats get_stats();
+
+    /**
+     * Class destructor.
+     */
+    virtual ~delta();
+
+private:
+
+    /**
+     * The signature of a single block.
+     */
+    struct block {
+
+        /**
+         * The weak checksum of the block.
+         *
+         * @see delta_weak()
+         */
+        uint32_t weak;
+
+        /**
+         * Unused; keeps the strong checksum aligned in the sidecar file.
+         */
+        uint32_t reserved;
+
+        /**
+         * The strong checksum of the block.
+         *
+         * @see delta_strong()
+         */
+        uint64_t strong;
+
+    };
+
+    /**
+     * The signature of the last uploaded version of a file, as stored in its
+     * sidecar file.
+     */
+    struct signature {
+
+        /**
+         * The entity tag of the full copy of the file that the patches
+         * apply to, as returned by s3::get_etag().
+         */
+        string etag;
+
+        /**
+         * The size of the file, in bytes.
+         */
+        uint64_t size;
+
+        /**
+         * The number of patches uploaded since the last full copy.
+         */
+        uint64_t patches;
+
+        /**
+         * The total size of the patches uploaded since the last full copy.
+         */
+        uint64_t patch_bytes;
+
+        /**
+         * The signature of each block of the file.
+         */
+        vector<block> blocks;
+
+    };
+
+    /**
+     * A single instruction in a patch, which either copies a range of the
+     * previous version of the file or takes literal data from the patch.
+     */
+    struct op {
+
+        /**
+         * The offset within the new version of the file.
+         */
+        uint64_t offset;
+
+        /**
+         * The number of bytes covered by the instruction.
+         */
+        uint64_t length;
+
+        /**
+         * The offset within the previous version to copy from, or -1 if the
+         * data is literal and follows the instructions in the patch.
+         */
+        int64_t source;
+
+    };
+
+    /**
+     * Compute the block signatures of a file.
+     *
+     * @param source
+     *     The file descriptor that the file contents are read from.
+     *
+     * @param size
+     *     The size of the file, in bytes.
+     *
+     * @param sig
+     *     The signature that receives the block signatures.
+     *
+     * @return
+     *     Zero on success, or -1 if the file could not be read in full.
+     */
+    static int sign(int source, size_t size, signature& sig);
+
+    /**
+     * Compare a file against the signature of its previous version, producing
+     * the instructions to rebuild the file from the previous version.
+     *
+     * @param source
+     *     The file descriptor that the file contents are read from.
+     *
+     * @param size
+     *     The size of the file, in bytes.
+     *
+     * @param sig
+     *     The signature of the previous version of the file.
+     *
+     * @param ops
+     *     The vector that receives the instructions.
+     *
+     * @return
+     *     The number of bytes of literal data in the instructions, or -1 if
+     *     the file could not be read in full.
+     */
+    static int64_t diff(int source, size_t size, const signature& sig,
+            vector<op>& ops);
+
+    /**
+     * Load the signature of a file from its sidecar file.
+     *
+     * @param path
+     *     The path of the sidecar file.
+     *
+     * @param sig
+     *     The signature that receives the contents of the sidecar file.
+     *
+     * @return
+     *     Zero on success, or -1 if the sidecar file is missing or invalid.
+     */
+    static int load(const string& path, signature& sig);
+
+    /**
+     * Save the signature of a file to its sidecar file, replacing the file
+     * atomically.
+     *
+     * @param path
+     *     The path of the sidecar file.
+     *
+     * @param sig
+     *     The signature to save.
+     *
+     * @return
+     *     Zero on success, or -1 if the sidecar file could not be written.
+     */
+    static int save(const string& path, const signature& sig);
+
+    /**
+     * The directory that block signatures are kept in.
+     */
+    string catalog;
+
+    /**
+     * The running totals of the data handled so far.
+     */
+    delta_stats stats;
+
+};
+
+#endif /* DELTA_H */
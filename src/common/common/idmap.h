@@ -0,0 +1,178 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef IDMAP_H
+#define IDMAP_H
+
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+
+using namespace std;
+
+/**
+ * A persistent map between file paths and the object IDs stored in each
+ * file's HSM xattr. The object ID travels with a file when it is renamed, so
+ * this map is not needed to find a file's cloud copy; it is used to find the
+ * cloud copy of a file that has been lost locally, and to spot files that
+ * were copied along with their xattrs and so share another file's object ID.
+ * Renaming a directory only updates the entries beneath it.
+ */
+class idmap {
+public:
+
+    /**
+     * Constructor for an ID map stored in the given file.
+     *
+     * @param map_file
+     *     The path of the file the map is loaded from and saved to.
+     */
+    idmap(string map_file);
+
+    /**
+     * Load the map from its file, replacing anything already in the map.
+     * A missing file is treated as an empty map.
+     *
+     * @return
+     *     Zero on success, or -1 if the file could not be read.
+     */
+    int load();
+
+    /**
+     * Save the map to its file, replacing the file atomically.
+     *
+     * @return
+     *     Zero on success, or -1 if the file could not be written.
+     */
+    int save();
+
+    /**
+     * Record a file in the map, assigning it an object ID if it does not
+     * have one. If the object ID of the file is already recorded for a
+     * different inode, the file is a copy and is given a new object ID,
+     * which marks it dirty and moves its write generation on so that it is
+     * uploaded, even if an upload under the old ID is still running. Stubs
+     * are never given a new object ID: a stub whose ID is recorded for a
+     * different inode keeps its ID. A stub or clean file with no ID is left
+     * out of the map until its path-based object has been moved by
+     * s3::migrate_files(), so that it is not uploaded again.
+     *
+     * @param fd
+     *     The file descriptor of the file being recorded.
+     *
+     * @param path
+     *     The path of the file.
+     *
+     * @return
+     *     Zero on success, or -1 if an object ID could not be assigned.
+     */
+    int add(int fd, string path);
+
+    /**
+     * Returns the object ID recorded for a path.
+     *
+     * @param path
+     *     The path of the file.
+     *
+     * @return
+     *     The object ID, or an empty string if the path is not in the map.
+     */
+    string lookup(string path);
+
+    /**
+     * Update the map after a file or directory has been renamed or moved,
+     * as reported by a FAN_RENAME or FAN_MOVED_FROM/FAN_MOVED_TO event. Only
+     * metadata is changed; the cloud copies of the files are not touched.
+     *
+     * @param from
+     *     The old path of the file or directory.
+     *
+     * @param to
+     *     The new path of the file or directory.
+     *
+     * @return
+     *     The number of entries whose path was updated.
+     */
+    size_t rename(string from, string to);
+
+    /**
+     * Remove a file, or a directory and everything beneath it, from the map.
+     *
+     * @param path
+     *     The path of the file or directory that has been removed.
+     *
+     * @return
+     *     The number of entries removed.
+     */
+    size_t remove(string path);
+
+    /**
+     * Class destructor.
+     */
+    virtual ~idmap();
+
+private:
+
+    /**
+     * The object ID and inode number recorded for a path.
+     */
+    struct record {
+
+        /**
+         * The object ID of the file.
+         */
+        string id;
+
+        /**
+         * The inode number of the file.
+         */
+        ino_t ino;
+
+    };
+
+    /**
+     * Returns the range of entries beneath the given directory, not
+     * including the directory itself.
+     *
+     * @param path
+     *     The path of a directory.
+     *
+     * @return
+     *     The first entry in the range and the entry just past its end.
+     */
+    pair<map<string, record>::iterator, map<string, record>::iterator>
+            subtree(const string& path);
+
+    /**
+     * The path of the file the map is stored in.
+     */
+    string map_file;
+
+    /**
+     * The entries of the map, keyed and sorted by path so that every entry
+     * beneath a directory is found in a single range.
+     */
+    map<string, record> paths;
+
+    /**
+     * The inode number recorded for each object ID.
+     */
+    unordered_map<string, ino_t> ids;
+
+};
+
+#endif /* IDMAP_H */
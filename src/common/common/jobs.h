@@ -0,0 +1,230 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * The job kind for uploading a dirty file to the cloud.
+ */
+#define JOB_UPLOAD 1
+
+/**
+ * The job kind for replacing a file with a stub.
+ */
+#define JOB_STUB 2
+
+/**
+ * The job kind for recalling the contents of a stub file from the cloud.
+ */
+#define JOB_RECALL 3
+
+/**
+ * The default time, in seconds, that a lease on a file lasts before it must
+ * be renewed.
+ */
+#define JOB_LEASE_TTL 60
+
+/**
+ * A job table and queue shared, through POSIX shared memory, between the
+ * monitor, the offload program, and any extra offload worker processes
+ * working on the same filesystem. Before any process works on a file it
+ * claims a lease on the file's inode, so that offload never stubs a file that
+ * monitor is uploading and no two processes upload the same dirty file. Work
+ * can also be handed out through the queue, which any number of processes can
+ * push to and pop from.
+ *
+ * The table is split into shards, each guarded by a process-shared, robust
+ * mutex. These are futexes underneath, so an uncontended claim or release
+ * never enters the kernel. If a process dies while holding a shard lock, the
+ * next process to take the lock recovers it, and any leases held by a thread
+ * that has exited are taken over by the next thread to claim the file, or
+ * released by reap().
+ *
+ * The shared memory is named after the device and the layout version of the
+ * table, so an upgraded build that changes the layout starts a new table
+ * rather than attaching to, or removing, the one older processes still use.
+ * A new table is only linked into place once it is fully set up.
+ */
+class jobs {
+public:
+
+    /**
+     * Constructor that attaches to the job table for the given filesystem,
+     * creating it if this is the first process to attach.
+     *
+     * @param dev
+     *     The device number of the filesystem.
+     */
+    jobs(dev_t dev);
+
+    /**
+     * Returns whether the job table was attached successfully.
+     *
+     * @return
+     *     True if the job table can be used, false otherwise.
+     */
+    bool is_attached();
+
+    /**
+     * Claim a lease on a file for the calling thread. A lease held by another
+     * thread, even one in this process, is only taken over if it has expired
+     * or the thread holding it has exited.
+     *
+     * @param ino
+     *     The inode number of the file.
+     *
+     * @param kind
+     *     The kind of work being done on the file, such as JOB_UPLOAD.
+     *
+     * @param ttl
+     *     The time, in seconds, that the lease lasts before it must be
+     *     renewed.
+     *
+     * @return
+     *     1 if the lease was claimed or renewed, 0 if another thread holds
+     *     it, or -1 if the table is full or not attached.
+     */
+    int claim(ino_t ino, int kind, int ttl);
+
+    /**
+     * Renew a lease held by the calling thread.
+     *
+     * @param ino
+     *     The inode number of the file.
+     *
+     * @param ttl
+     *     The time, in seconds, that the lease lasts from now.
+     *
+     * @return
+     *     Zero on success, or -1 if the calling thread does not hold the
+     *     lease.
+     */
+    int renew(ino_t ino, int ttl);
+
+    /**
+     * Release a lease held by the calling thread.
+     *
+     * @param ino
+     *     The inode number of the file.
+     *
+     * @return
+     *     Zero on success, or -1 if the calling thread does not hold the
+     *     lease.
+     */
+    int release(ino_t ino);
+
+    /**
+     * Queue a job for any attached process to pick up.
+     *
+     * @param ino
+     *     The inode number of the file.
+     *
+     * @param kind
+     *     The kind of work to be done on the file, such as JOB_UPLOAD.
+     *
+     * @return
+     *     Zero on success, or -1 if the queue is full or not attached.
+     */
+    int push(ino_t ino, int kind);
+
+    /**
+     * Take the next job from the queue, waiting for one if the queue is
+     * empty. The job must still be claimed before it is worked on, and must
+     * be acknowledged with ack() once it has been claimed or is no longer
+     * needed; until then it is put back on the queue by reap() if the
+     * calling thread exits or JOB_LEASE_TTL passes.
+     *
+     * @param ino
+     *     Receives the inode number of the file.
+     *
+     * @param kind
+     *     Receives the kind of work to be done on the file.
+     *
+     * @param timeout_ms
+     *     The longest time, in milliseconds, to wait for a job, or -1 to wait
+     *     indefinitely.
+     *
+     * @return
+     *     1 if a job was taken, 0 if the wait timed out, or -1 if an error
+     *     occurs. The wait also times out while too many jobs are taken but
+     *     not yet acknowledged; it ends as soon as one is acknowledged.
+     */
+    int pop(ino_t* ino, int* kind, int timeout_ms);
+
+    /**
+     * Acknowledge a job taken from the queue by the calling thread, so that
+     * it is not put back on the queue.
+     *
+     * @param ino
+     *     The inode number of the file.
+     *
+     * @return
+     *     Zero on success, or -1 if the calling thread has no such job.
+     */
+    int ack(ino_t ino);
+
+    /**
+     * Release every lease held by a thread that has exited or that has
+     * expired, and put back on the queue every job taken but not
+     * acknowledged by such a thread. This happens without reap() as well:
+     * claim() takes over such leases, and clears them out of a shard that
+     * is full, and pop() puts back such jobs whenever it has nothing else to
+     * take, checking at least every second while it waits. Calling reap()
+     * from a periodic pass frees space in the table sooner.
+     *
+     * @return
+     *     The number of leases released and jobs put back.
+     */
+    size_t reap();
+
+    /**
+     * Destructor, which releases every lease held by this process and
+     * detaches from the job table.
+     */
+    virtual ~jobs();
+
+private:
+
+    /**
+     * The layout of the shared memory, defined in jobs.cpp.
+     */
+    struct table;
+
+    /**
+     * Create and set up a job table, unless another process does so first.
+     *
+     * @param name
+     *     The path of the shared memory object holding the table.
+     *
+     * @return
+     *     The file descriptor of the shared memory object, whether created by
+     *     this process or another, or -1 if an error occurs.
+     */
+    static int create(const char* name);
+
+    /**
+     * The shared memory the job table is mapped into, or NULL if it could
+     * not be attached.
+     */
+    table* shared;
+
+};
+
+#endif /* JOBS_H */
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REPLICAS_H
+#define REPLICAS_H
+
+#include "common/s3.h"
+
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+/**
+ * The smallest size, in bytes, of each buffer read from a file being
+ * replicated. This is also the size of each part of the multipart uploads.
+ */
+#define REPLICA_CHUNK_SIZE (8 * 1024 * 1024)
+
+/**
+ * The largest number of parts a multipart upload may have. Files too large to
+ * be sent in this many parts of REPLICA_CHUNK_SIZE are sent in larger parts.
+ */
+#define REPLICA_MAX_PARTS 10000
+
+/**
+ * The number of buffers that may be held in memory at once while replicating
+ * a file, which bounds how far the fastest replica can get ahead of the
+ * slowest.
+ */
+#define REPLICA_WINDOW 4
+
+/**
+ * The maximum number of replicas, limited by the size of the replica mask
+ * stored with each file.
+ *
+ * @see HSM_XATTR_REPLICAS_NAME
+ */
+#define REPLICA_MAX 32
+
+/**
+ * A set of S3 targets that every file is replicated to, for example a bucket
+ * in the primary region and a bucket on an on-premises S3-compatible store.
+ * Each file is read once and the same buffers are sent to every replica
+ * concurrently. Which replicas hold a current copy is recorded with the file,
+ * so that a failed upload is only retried against the replicas that missed
+ * it. Recalls are served by whichever replica responds first.
+ */
+class replicas {
+public:
+
+    /**
+     * Constructor for a replica set.
+     *
+     * @param targets
+     *     The S3 targets to replicate to, in order of preference. Only the
+     *     first REPLICA_MAX targets are used.
+     */
+    replicas(vector<s3> targets);
+
+    /**
+     * Upload a file to every replica that does not yet hold the given write
+     * generation of it, reading the data once from the given source. Which
+     * replicas hold the generation is only recorded if the file has not
+     * been written to since, so a write made during the upload leaves every
+     * replica out of date.
+     *
+     * @param fd
+     *     The file descriptor of the file whose object is being uploaded.
+     *
+     * @param source
+     *     The file descriptor that the file contents are read from.
+     *
+     * @param gen
+     *     The write generation of the file that the source holds.
+     *
+     * @return
+     *     The number of bytes read from the source if every replica now holds
+     *     the given generation, or -1 if any replica does not.
+     */
+    ssize_t upload_file(int fd, int source, uint64_t gen);
+
+    /**
+     * Download a file from the replica that responds first. A lookup is sent
+     * to the replica with the lowest observed latency; if it has not answered
+     * within twice its usual latency, a backup lookup is sent to the next
+     * replica, and so on. If the download from the first replica to answer
+     * fails, the remaining replicas are tried in turn. Lookups still running
+     * once the file has been downloaded are left to finish on their own.
+     *
+     * @param fd
+     *     The file descriptor of the file that should be retrieved.
+     *
+     * @return
+     *     The number of bytes downloaded, or -1 if no replica could provide
+     *     the file.
+     */
+    ssize_t download_file(int fd);
+
+    /**
+     * Returns the number of replicas in the set.
+     *
+     * @return
+     *     The number of replicas.
+     */
+    size_t size();
+
+    /**
+     * Class destructor.
+     */
+    virtual ~replicas();
+
+private:
+
+    /**
+     * The moving average response times of the replicas, which are shared
+     * with any lookups still running after the recall that sent them.
+     */
+    struct latencies {
+
+        /**
+         * The lock guarding the averages.
+         */
+        mutex lock;
+
+        /**
+         * The moving average response time of each replica, in
+         * milliseconds.
+         */
+        vector<double> ms;
+
+    };
+
+    /**
+     * Record an observed response time for a replica.
+     *
+     * @param stats
+     *     The response times of the replicas.
+     *
+     * @param index
+     *     The index of the replica.
+     *
+     * @param ms
+     *     The observed response time, in milliseconds.
+     */
+    static void observe(latencies& stats, size_t index, double ms);
+
+    /**
+     * Returns the indexes of the replicas ordered from the lowest observed
+     * latency to the highest.
+     *
+     * @return
+     *     The ordered replica indexes.
+     */
+    vector<size_t> by_latency();
+
+    /**
+     * The S3 targets in the set.
+     */
+    vector<s3> targets;
+
+    /**
+     * The response times of the replicas.
+     */
+    shared_ptr<latencies> latency;
+
+};
+
+#endif /* REPLICAS_H */
@@ -0,0 +1,159 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RESTORE_H
+#define RESTORE_H
+
+#include "common/s3.h"
+
+#include <vector>
+
+using namespace std;
+
+/**
+ * A queue of recalls for stub files whose cloud copies are held in an archive
+ * storage class. Restore requests are issued in bulk, and the queue is then
+ * polled periodically to download each file once its restore completes, so
+ * that no thread is left blocked for the hours an archive restore can take.
+ */
+class restore_queue {
+public:
+
+    /**
+     * Constructor for a restore queue against the given S3 target.
+     *
+     * @param target
+     *     The S3 target holding the cloud copies of the files.
+     *
+     * @param days
+     *     The number of days restored copies should remain available.
+     */
+    restore_queue(s3& target, int days);
+
+    /**
+     * Queue the recall of a stub file. The file descriptor is owned by the
+     * queue from this point on. If the recall was triggered by a fanotify
+     * permission event, the event may either be held until the file has been
+     * recalled, or denied straight away so that the user is told to try
+     * again later.
+     *
+     * @param fd
+     *     The file descriptor of the stub file to recall.
+     *
+     * @param fan_fd
+     *     The fanotify file descriptor the permission event was read from,
+     *     or -1 if the recall was not triggered by a permission event.
+     *
+     * @param hold
+     *     Whether the permission event should be held until the recall
+     *     completes, rather than denied straight away.
+     */
+    void add(int fd, int fan_fd, bool hold);
+
+    /**
+     * Issue restore requests, as a single batch, for every file queued since
+     * the last call. The outcome of each file is handled on its own: a
+     * restore already in progress counts as issued, a file whose cloud copy
+     * no longer exists is marked lost, and any other failure leaves the file
+     * queued to be tried again on the next flush, denying any permission
+     * event held for it so that the process reading it is not left blocked.
+     *
+     * @return
+     *     The number of restore requests issued or already in progress.
+     */
+    int flush();
+
+    /**
+     * Check every file whose restore has been requested, downloading any
+     * whose restored copy is now available and answering any permission
+     * events held for them. A file is only marked lost if its cloud copy no
+     * longer exists; a file whose restored copy expired before it could be
+     * downloaded is queued to be restored again, and other failures leave
+     * the recall waiting to be tried again on the next poll.
+     *
+     * @return
+     *     The number of files recalled.
+     */
+    int poll();
+
+    /**
+     * Returns the number of recalls that have not yet completed.
+     *
+     * @return
+     *     The number of outstanding recalls.
+     */
+    size_t size();
+
+    /**
+     * Destructor, which denies any permission events still held so that no
+     * process is left blocked reading a stub.
+     */
+    virtual ~restore_queue();
+
+private:
+
+    /**
+     * A single queued recall.
+     */
+    struct recall {
+
+        /**
+         * The file descriptor of the stub file being recalled.
+         */
+        int fd;
+
+        /**
+         * The fanotify file descriptor of a held permission event, or -1 if
+         * no event is held.
+         */
+        int fan_fd;
+
+    };
+
+    /**
+     * Answer a held permission event, if any, and close the file.
+     *
+     * @param r
+     *     The recall being completed.
+     *
+     * @param allow
+     *     Whether access to the file should be allowed.
+     */
+    static void finish(const recall& r, bool allow);
+
+    /**
+     * The S3 target holding the cloud copies of the files.
+     */
+    s3& target;
+
+    /**
+     * The number of days restored copies should remain available.
+     */
+    int days;
+
+    /**
+     * Recalls whose restore requests have not yet been issued.
+     */
+    vector<recall> queued;
+
+    /**
+     * Recalls whose restore requests have been issued.
+     */
+    vector<recall> requested;
+
+};
+
+#endif /* RESTORE_H */
@@ -26,6 +26,9 @@
 
 #include <stdbool.h>
 #include <string>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
 
 using namespace std;
 
@@ -87,22 +90,281 @@ public:
      */
     int upload_file(int fd);
     
+    /**
+     * Upload the contents read from a separate source file descriptor under
+     * the object key of the given file, returning the number of bytes
+     * uploaded, or -1 if the upload fails. This is used to upload from a
+     * point-in-time copy of a file while writers carry on with the live file.
+     * 
+     * @param fd
+     *     The file descriptor of the file whose object is being uploaded.
+     * 
+     * @param source
+     *     The file descriptor that the file contents are read from.
+     * 
+     * @return 
+     *     The number of bytes uploaded, or -1 if an error occurs.
+     */
+    ssize_t upload_file(int fd, int source);
+    
+    /**
+     * Begin a multipart upload of the object for the given file. The data is
+     * then sent with upload_part() and the upload finished with upload_end().
+     * This allows data that has already been read to be sent to more than
+     * one target without reading it again.
+     * 
+     * @param fd
+     *     The file descriptor of the file whose object is being uploaded.
+     * 
+     * @return 
+     *     Zero on success, or -1 if an error occurs.
+     */
+    int upload_begin(int fd);
+    
+    /**
+     * Upload a patch on top of the object for the given file, as produced by
+     * delta sync. Patches are stored alongside the object and numbered from
+     * one; download_file() applies them in order after downloading the
+     * object. Uploading a full copy of the file removes any patches.
+     * 
+     * @param fd
+     *     The file descriptor of the file whose object is being patched.
+     * 
+     * @param seq
+     *     The number of the patch.
+     * 
+     * @param patch
+     *     The file descriptor that the patch is read from.
+     * 
+     * @return 
+     *     The number of bytes uploaded, or -1 if an error occurs.
+     */
+    int upload_patch(int fd, int seq, int patch);
+    
+    /**
+     * Send one part of a multipart upload begun with upload_begin().
+     * 
+     * @param fd
+     *     The file descriptor of the file whose object is being uploaded.
+     * 
+     * @param data
+     *     The data to send.
+     * 
+     * @param size
+     *     The number of bytes of data to send.
+     * 
+     * @param offset
+     *     The offset within the file that the data was read from.
+     * 
+     * @return 
+     *     The number of bytes sent, or -1 if an error occurs.
+     */
+    ssize_t upload_part(int fd, const char* data, size_t size, off_t offset);
+    
+    /**
+     * Finish a multipart upload begun with upload_begin(), either completing
+     * it so that the object becomes visible, or aborting it.
+     * 
+     * @param fd
+     *     The file descriptor of the file whose object is being uploaded.
+     * 
+     * @param commit
+     *     Whether the upload should be completed rather than aborted.
+     * 
+     * @return 
+     *     Zero on success, or -1 if an error occurs.
+     */
+    int upload_end(int fd, bool commit);
+    
     /**
      * Download the file specified by the file descriptor into the location on
      * the filesystem, returning the number of bytes downloaded, or -1 if an
      * error occurs downloading the file. The key of the file in the S3 bucket
-     * will be determined by concatenating the bucket name, base prefix, and
-     * then the directory path of the file on the filesystem to get the full S3
-     * object key.
+     * is determined by get_object_key().
      * 
      * @param fd
      *     The file descriptor of the file that should be retrieved from the
      *     S3 bucket.
      * 
      * @return
-     *     The number of bytes downloaded, or -1 if an error occurs.
+     *     The number of bytes downloaded, or -1 if an error occurs. errno is
+     *     set to ENOENT if the object does not exist.
+     */
+    ssize_t download_file(int fd);
+    
+    /**
+     * Look up the object for the given file without downloading it.
+     * 
+     * @param fd
+     *     The file descriptor of the file whose object is being looked up.
+     * 
+     * @return
+     *     The size of the object, in bytes, or -1 if the object cannot be
+     *     found or an error occurs.
+     */
+    ssize_t stat_object(int fd);
+    
+    /**
+     * Returns the entity tag (ETag) of the object for the given file, which
+     * changes whenever the object is replaced by a full upload. Uploading a
+     * patch with upload_patch() does not change it.
+     * 
+     * @param fd
+     *     The file descriptor of the file whose object is being looked up.
+     * 
+     * @return
+     *     The entity tag of the object, or an empty string if the object
+     *     cannot be found or an error occurs.
+     */
+    string get_etag(int fd);
+    
+    /**
+     * Returns the S3 object key for the file specified by the file descriptor,
+     * which is the base prefix followed by the object ID of the file. A new
+     * object ID is assigned to the file if it does not yet have one. Since
+     * the key does not depend on the path of the file, renaming or moving
+     * files does not require anything to be uploaded again. A stub or clean
+     * file without an object ID was stored before object IDs were introduced
+     * (see hsm_is_legacy()), so its key is the base prefix followed by the
+     * path of the file, until the object is moved by migrate_files().
+     * 
+     * @param fd
+     *     The file descriptor of the file whose object key is being retrieved.
+     * 
+     * @return
+     *     The object key, or an empty string if an object ID could not be
+     *     assigned to the file.
+     */
+    string get_object_key(int fd);
+    
+    /**
+     * Move objects stored under their old, path-based keys to the keys given,
+     * as a single batch of server-side copies followed by deletes of the old
+     * objects. This is used to migrate existing cloud copies to object IDs
+     * without downloading or uploading any file data.
+     * 
+     * @param keys
+     *     Pairs of the old and new object keys.
+     * 
+     * @param results
+     *     The vector that receives the outcome for each pair, in the same
+     *     order: zero if the object was moved, or the errno of the failure
+     *     otherwise, in which case the old object is left in place.
+     * 
+     * @return
+     *     The number of objects moved.
+     */
+    int rename_objects(vector<pair<string, string>>& keys,
+            vector<int>& results);
+    
+    /**
+     * Move the cloud copies of files stored before object IDs were
+     * introduced from their path-based keys to new object IDs, with
+     * rename_objects(), and record the new ID in each file whose object was
+     * moved. No file data is uploaded, and the files are left clean. Files
+     * that are not stored under their path are skipped.
+     * 
+     * @param fds
+     *     The file descriptors of the files to migrate.
+     * 
+     * @return
+     *     The number of files migrated, or -1 if an error occurs.
+     */
+    int migrate_files(vector<int>& fds);
+    
+    /**
+     * Move the cloud copies of the given files into a different storage
+     * class. This is done with a server-side copy of each object onto itself
+     * with the new storage class, so that no file data is uploaded again.
+     * The requests are issued as a single batch.
+     * 
+     * @param fds
+     *     The file descriptors of the files whose cloud copies should be
+     *     moved.
+     * 
+     * @param tier
+     *     The name of the storage class the objects should be moved into.
+     * 
+     * @return
+     *     The number of objects moved, or -1 if an error occurs.
+     */
+    int change_tier(vector<int>& fds, string tier);
+    
+    /**
+     * Issue restore requests for the cloud copies of the given files, which
+     * are held in an archive storage class and cannot be downloaded directly.
+     * The requests are issued as a single batch and return immediately; use
+     * restore_ready() to find out when each restored copy is available.
+     * 
+     * @param fds
+     *     The file descriptors of the stub files whose cloud copies should be
+     *     restored.
+     * 
+     * @param days
+     *     The number of days the restored copies should remain available.
+     * 
+     * @param results
+     *     The vector that receives the outcome for each file, in the same
+     *     order as the file descriptors: zero if the restore was issued or
+     *     was already in progress, or the errno of the failure otherwise,
+     *     which is ENOENT if the object does not exist.
+     * 
+     * @return
+     *     The number of restore requests issued or already in progress.
      */
-    int download_file(int fd);
+    int restore_files(vector<int>& fds, int days, vector<int>& results);
+    
+    /**
+     * Check whether a restore previously requested with restore_files() has
+     * completed, so that the file can be downloaded.
+     * 
+     * @param fd
+     *     The file descriptor of the stub file being restored.
+     * 
+     * @return
+     *     1 if the restored copy is available, 0 if the restore is still in
+     *     progress, or -1 if an error occurs. errno is set to ENOENT if the
+     *     object does not exist, which is the only error that means the
+     *     cloud copy of the file is gone rather than unreachable for now,
+     *     and to ESTALE if no restore is in progress and no restored copy
+     *     is available, as when a restored copy has expired, in which case
+     *     the restore must be requested again.
+     */
+    int restore_ready(int fd);
+    
+    /**
+     * Returns the endpoint of the S3-compatible service holding the bucket.
+     * 
+     * @return
+     *     The endpoint URL, or an empty string for AWS S3.
+     */
+    string get_endpoint();
+    
+    /**
+     * Set the endpoint of the S3-compatible service holding the bucket, for
+     * example an on-premises object store.
+     * 
+     * @param endpoint
+     *     The endpoint URL, or an empty string for AWS S3.
+     */
+    void set_endpoint(string endpoint);
+    
+    /**
+     * Returns the storage class that newly uploaded files are placed in.
+     * 
+     * @return
+     *     The name of the default storage class for uploads.
+     */
+    string get_tier();
+    
+    /**
+     * Set the storage class that newly uploaded files are placed in.
+     * 
+     * @param tier
+     *     The name of the default storage class for uploads, for example
+     *     "INTELLIGENT_TIERING".
+     */
+    void set_tier(string tier);
     
     /**
      * Destructor for the s3 class.
@@ -133,6 +395,18 @@ private:
      * an IAM role is used to access the bucket.
      */
     string secret_key;
+    
+    /**
+     * The storage class that newly uploaded files are placed in. If empty,
+     * the bucket default is used.
+     */
+    string tier;
+    
+    /**
+     * The endpoint of the S3-compatible service holding the bucket. If empty,
+     * AWS S3 is used.
+     */
+    string endpoint;
 
 };
 
@@ -0,0 +1,218 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "common/replicas.h"
+#include "common/s3.h"
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * A batch of dirty files that are uploaded from a consistent, point-in-time
+ * copy rather than from the live files, so that writers never have to be
+ * blocked and a file that is being written to is never uploaded half
+ * written. On ZFS, a snapshot of the dataset is taken for the whole batch and
+ * files are read from the .zfs/snapshot directory. Otherwise, each file is
+ * cloned with a reflink (FICLONE) just before it is uploaded, which is also
+ * supported by ZFS 2.2 and newer with block cloning enabled.
+ */
+class snapshot {
+public:
+
+    /**
+     * Constructor for a batch that reads files through reflinks only.
+     *
+     * @param mountpoint
+     *     The directory where the filesystem holding the files is mounted.
+     */
+    snapshot(string mountpoint);
+
+    /**
+     * Constructor for a batch that reads files from a ZFS snapshot.
+     *
+     * @param mountpoint
+     *     The directory where the ZFS dataset holding the files is mounted.
+     *
+     * @param dataset
+     *     The name of the ZFS dataset, for example "tank/hsm".
+     */
+    snapshot(string mountpoint, string dataset);
+
+    /**
+     * Add a dirty file to the batch, recording its current write generation.
+     * This must be done before take() is called. The file descriptor is owned
+     * by the batch once added, and is closed by upload().
+     *
+     * @param fd
+     *     The file descriptor of the dirty file.
+     */
+    void add(int fd);
+
+    /**
+     * Take the ZFS snapshot that the files in the batch will be read from.
+     * This does nothing if no ZFS dataset was given. The first snapshot of
+     * each dataset taken by a process also sweeps away the stale snapshots
+     * of that dataset, as sweep() does.
+     *
+     * @return
+     *     Zero on success, or -1 if the snapshot could not be taken.
+     */
+    int take();
+
+    /**
+     * Upload every file in the batch from its point-in-time copy, clearing
+     * the dirty flag of each file that has not been written to since the copy
+     * was taken. A file is read from the snapshot only if it is still the
+     * same inode there, and otherwise from a reflink. If the filesystem does
+     * not support reflinks, the live file is read instead, and is left dirty
+     * if it is written to while being uploaded.
+     *
+     * @param target
+     *     The S3 target the files are uploaded to.
+     *
+     * @return
+     *     The number of files uploaded.
+     */
+    int upload(s3& target);
+
+    /**
+     * Upload every file in the batch to a set of replicas, as upload(s3&)
+     * does. A file is only marked clean once every replica holds a current
+     * copy of it.
+     *
+     * @param targets
+     *     The replicas the files are uploaded to.
+     *
+     * @return
+     *     The number of files uploaded to every replica.
+     */
+    int upload(replicas& targets);
+
+    /**
+     * Destroy every snapshot of a dataset left behind by a batch whose
+     * process is no longer running, such as after a crash, so that stale
+     * snapshots do not keep holding on to space.
+     *
+     * @param dataset
+     *     The name of the ZFS dataset, for example "tank/hsm".
+     *
+     * @return
+     *     The number of snapshots destroyed, or -1 if the snapshots could not
+     *     be listed.
+     */
+    static int sweep(string dataset);
+
+    /**
+     * Destructor, which destroys the ZFS snapshot, if one was taken, and
+     * closes any files that were not uploaded.
+     */
+    virtual ~snapshot();
+
+private:
+
+    /**
+     * A single file in the batch.
+     */
+    struct entry {
+
+        /**
+         * The file descriptor of the live file.
+         */
+        int fd;
+
+        /**
+         * The write generation of the file when it was added to the batch.
+         */
+        uint64_t gen;
+
+    };
+
+    /**
+     * Upload every file in the batch with the given upload function.
+     *
+     * @param upload_file
+     *     The function that uploads a file, given the file descriptor of the
+     *     live file, the file descriptor of its copy, and the write
+     *     generation the copy holds, returning -1 if the upload fails.
+     *
+     * @return
+     *     The number of files uploaded.
+     */
+    int upload_with(function<ssize_t(int, int, uint64_t)> upload_file);
+
+    /**
+     * Open the point-in-time copy of a file for reading.
+     *
+     * @param fd
+     *     The file descriptor of the live file.
+     *
+     * @return
+     *     A file descriptor for the copy, or -1 if no copy could be made.
+     */
+    int open_copy(int fd);
+
+    /**
+     * Run the zfs command with the given arguments and wait for it to exit.
+     *
+     * @param args
+     *     The arguments to the zfs command.
+     *
+     * @param output
+     *     The string that receives the standard output of the command, or
+     *     NULL if it is not needed.
+     *
+     * @return
+     *     Zero if the command succeeds, or -1 if it fails.
+     */
+    static int zfs(vector<string> args, string* output);
+
+    /**
+     * The directory where the filesystem holding the files is mounted.
+     */
+    string mountpoint;
+
+    /**
+     * The name of the ZFS dataset, or empty if reflinks are used.
+     */
+    string dataset;
+
+    /**
+     * The name of the ZFS snapshot, or empty if none has been taken.
+     */
+    string name;
+
+    /**
+     * Whether files are still being cloned with reflinks. This is cleared
+     * once a clone fails, so that the rest of the batch reads the live files
+     * without trying again.
+     */
+    bool reflinks;
+
+    /**
+     * The files in the batch.
+     */
+    vector<entry> entries;
+
+};
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,220 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TIER_H
+#define TIER_H
+
+#include "common/s3.h"
+
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <time.h>
+#include <vector>
+
+using namespace std;
+
+/**
+ * The characteristics of a single cloud storage class that are used when
+ * deciding where the cloud copy of a file should be placed.
+ */
+struct storage_class {
+
+    /**
+     * The name of the storage class, as used by S3.
+     */
+    const char* name;
+
+    /**
+     * The cost of storing data in the class, per GB per month.
+     */
+    double storage_cost;
+
+    /**
+     * The cost of retrieving data from the class, per GB.
+     */
+    double retrieval_cost;
+
+    /**
+     * The time, in seconds, between requesting data from the class and the
+     * first byte of data being available.
+     */
+    time_t first_byte;
+
+    /**
+     * Whether objects in the class must be restored before they can be
+     * downloaded.
+     */
+    bool archive;
+
+    /**
+     * The minimum number of days an object is charged for once it is placed
+     * in the class, even if it is deleted or moved out sooner.
+     */
+    int min_days;
+
+};
+
+/**
+ * The fraction by which a storage class must be cheaper than the current one
+ * before a file is moved, so that a file whose recall rate hovers near the
+ * boundary between two classes is not moved back and forth.
+ */
+#define TIER_HYSTERESIS 0.2
+
+/**
+ * Look up the characteristics of a storage class by name.
+ *
+ * @param name
+ *     The name of the storage class, for example "GLACIER".
+ *
+ * @return
+ *     The storage class, or NULL if the name is not known.
+ */
+const storage_class* tier_find(const char* name);
+
+/**
+ * Estimate the number of times per month a file will be recalled if it is
+ * stubbed, based on the access history stored with the file. The estimate is
+ * the file's average access rate since it was first seen, scaled down by the
+ * number of months since it was last accessed, so that files which were
+ * once busy but have since gone quiet cool off over time.
+ *
+ * @param fd
+ *     The file descriptor of the file whose recall rate is being estimated.
+ *
+ * @param now
+ *     The current time.
+ *
+ * @return
+ *     The estimated number of recalls per month.
+ */
+double tier_recall_rate(int fd, time_t now);
+
+/**
+ * Choose the cheapest storage class for a file that still meets the given
+ * recall latency target. The cost of each class is its monthly storage cost
+ * plus its retrieval cost multiplied by the estimated recall rate.
+ *
+ * @param fd
+ *     The file descriptor of the file being placed.
+ *
+ * @param latency
+ *     The longest acceptable time, in seconds, to recall the file.
+ *
+ * @param now
+ *     The current time.
+ *
+ * @return
+ *     The storage class the file should be placed in.
+ */
+const storage_class* tier_select(int fd, time_t latency, time_t now);
+
+/**
+ * A batch of storage class transitions, collected by the offload program as
+ * it scans a directory and then applied together so that each storage class
+ * needs only a single batch of server-side copies. Objects in an archive
+ * storage class must be restored before they can be copied, so moving one of
+ * those takes two passes: the first requests the restore, and a later pass
+ * makes the move once the restored copy is available.
+ */
+class tier_batch {
+public:
+
+    /**
+     * Constructor for a batch of transitions against the given S3 target.
+     *
+     * @param target
+     *     The S3 target holding the cloud copies of the files.
+     *
+     * @param latency
+     *     The longest acceptable time, in seconds, to recall a file.
+     *
+     * @param days
+     *     The number of days restored copies of archived objects should
+     *     remain available while they are moved.
+     */
+    tier_batch(s3& target, time_t latency, int days);
+
+    /**
+     * Check whether the cloud copy of a stub file is in the right storage
+     * class, and queue a transition, or the restore that must come before
+     * it, if it is not. A file with no recorded storage class is taken to be
+     * in the class configured for the target, and files in a class that
+     * manages its own placement, such as INTELLIGENT_TIERING, are never
+     * moved. A file is only moved once it has spent the minimum charged
+     * duration in its current class, and only if the new class is cheaper
+     * by at least TIER_HYSTERESIS. A restore that expired before the move
+     * was made is requested again. The file descriptor is owned by the batch
+     * from this point on.
+     *
+     * @param fd
+     *     The file descriptor of the stub file being checked.
+     *
+     * @return
+     *     1 if a transition or restore was queued, or 0 if the file is
+     *     already in the right storage class or is still being restored.
+     */
+    int add(int fd);
+
+    /**
+     * Issue all queued restores as a single batch, then apply all queued
+     * transitions, recording the new storage class of each file that was
+     * moved. A restore that cannot be issued is tried again on a later pass.
+     *
+     * @return
+     *     The number of files moved, or -1 if any transition failed.
+     */
+    int flush();
+
+    /**
+     * Destructor, which applies any transitions still queued.
+     */
+    virtual ~tier_batch();
+
+private:
+
+    /**
+     * The S3 target holding the cloud copies of the files.
+     */
+    s3& target;
+
+    /**
+     * The longest acceptable time, in seconds, to recall a file.
+     */
+    time_t latency;
+
+    /**
+     * The number of days restored copies of archived objects should remain
+     * available.
+     */
+    int days;
+
+    /**
+     * The files whose archived objects must be restored before they can be
+     * moved.
+     */
+    vector<int> restores;
+
+    /**
+     * The queued transitions, as file descriptors keyed by the name of the
+     * storage class they are moving into.
+     */
+    map<string, vector<int>> pending;
+
+};
+
+#endif /* TIER_H */
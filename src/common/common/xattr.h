@@ -17,6 +17,10 @@
 #ifndef XATTR_H
 #define XATTR_H
 
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
 /**
  * The name of the extended attribute that stores the HSM-related flags
  * for a particular file. 
@@ -63,6 +67,20 @@
  */
 #define HSM_XATTR_FLAG_LOST 8
 
+/**
+ * The bit in the HSM flags that indicates that a stub file is held in an
+ * archive storage class (such as GLACIER) and that a restore request has been
+ * issued for it, but the restored copy has not yet been used. When the
+ * restore is for a recall, this bit is set alongside the recall bit and is
+ * cleared once the file has been downloaded; when it is for moving the cloud
+ * copy into another storage class, it is set on its own and cleared once the
+ * move has been made.
+ * 
+ * @see HSM_XATTR_FLAG_NAME
+ * @see HSM_XATTR_FLAG_RECALL
+ */
+#define HSM_XATTR_FLAG_RESTORE 16
+
 /**
  * The extended attribute (xattr) that stores the file stat information for
  * a file that has been stubbed to the cloud. This data can be used by
@@ -73,6 +91,67 @@
  */
 #define HSM_XATTR_STAT_NAME "user.hsm.stat"
 
+/**
+ * The extended attribute (xattr) that stores the access history for a file,
+ * which is used to judge how "hot" a file is when choosing the storage class
+ * it is offloaded to. The format of the data is:
+ * 
+ * /[accesses]/[recalls]/[first seen (s)]/[last access (s)]
+ */
+#define HSM_XATTR_TEMP_NAME "user.hsm.temp"
+
+/**
+ * The extended attribute (xattr) that stores the name of the storage class
+ * (for example, "STANDARD_IA" or "GLACIER") that the cloud copy of a file
+ * currently resides in.
+ */
+#define HSM_XATTR_TIER_NAME "user.hsm.tier"
+
+/**
+ * The extended attribute (xattr) that stores the time, in seconds since the
+ * epoch, that the cloud copy of a file was moved into its current storage
+ * class, as a 64-bit integer.
+ */
+#define HSM_XATTR_TIER_TIME_NAME "user.hsm.tier.time"
+
+/**
+ * The extended attribute (xattr) that stores the write generation of a file,
+ * a 64-bit counter that is incremented each time the file is marked dirty.
+ * This allows an upload taken from a point-in-time copy of the file to tell
+ * whether the file has been written to since the copy was taken.
+ */
+#define HSM_XATTR_GEN_NAME "user.hsm.gen"
+
+/**
+ * The extended attribute (xattr) that stores the object ID of a file, a
+ * random UUID that names the cloud copy of the file. Because the ID stays
+ * with the file rather than its path, renaming or moving a file or any of
+ * its parent directories does not change the object it is stored in.
+ */
+#define HSM_XATTR_ID_NAME "user.hsm.id"
+
+/**
+ * The length, in characters, of an object ID, not including the null
+ * terminator.
+ * 
+ * @see HSM_XATTR_ID_NAME
+ */
+#define HSM_ID_LENGTH 36
+
+/**
+ * The extended attribute (xattr) that stores which replicas hold a current
+ * copy of a file. The format of the data is:
+ * 
+ * uint64_t  The write generation of the file that was uploaded.
+ * uint64_t  A mask with one bit per replica, in the order the replicas are
+ *           configured, of the replicas holding that generation.
+ * 
+ * The mask only describes the generation stored with it, so it means nothing
+ * once the file has been written to again. It is also removed whenever the
+ * file is marked dirty.
+ */
+#define HSM_XATTR_REPLICAS_NAME "user.hsm.replicas"
+
 /**
  * Clear the dirty flag from a file given a file descriptor that points to
  * the file. This marks the file as "clean", meaning that local file contents
@@ -86,6 +165,24 @@
  */
 ssize_t hsm_clear_dirty(int fd);
 
+/**
+ * Clear the dirty flag from a file, as hsm_clear_dirty() does, but only if the
+ * write generation of the file still matches the given generation. This is
+ * used after uploading from a point-in-time copy of a file, so that writes
+ * made after the copy was taken leave the file dirty.
+ * 
+ * @param fd
+ *     The file descriptor of the file that should be marked as clean.
+ * 
+ * @param gen
+ *     The write generation of the file at the time the copy was taken.
+ * 
+ * @return 
+ *     1 if the file was marked clean, 0 if the file has been written to since
+ *     the copy was taken and remains dirty, or -1 if an error occurs.
+ */
+int hsm_clear_dirty_gen(int fd, uint64_t gen);
+
 /**
  * Clear the "lost" flags on a file given a file descriptor pointing to the
  * file. This clears the status that indicates that the cloud portion of a
@@ -114,6 +211,20 @@ ssize_t hsm_clear_lost(int fd);
  */
 ssize_t hsm_clear_recall(int fd);
 
+/**
+ * Clear the "restore" flag from a file given a file descriptor pointing to the
+ * file. This indicates that the archive restore of a stub file has completed
+ * and the file contents can now be downloaded.
+ * 
+ * @param fd
+ *     A file descriptor pointing to the file whose restore flag should be
+ *     cleared.
+ * 
+ * @return 
+ *     The number of bytes written to the xattr when setting the flags.
+ */
+ssize_t hsm_clear_restore(int fd);
+
 /**
  * Clear the "stub" flag on a file given a file descriptor pointing to the file
  * whose flag should be cleared. This indicates that the contents of a file
@@ -127,6 +238,19 @@ ssize_t hsm_clear_recall(int fd);
  */
 ssize_t hsm_clear_stub(int fd);
 
+/**
+ * Retrieve the number of times a file has been accessed since it was first
+ * seen by CloudSM, as recorded by hsm_record_access().
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose access count is being
+ *     retrieved.
+ * 
+ * @return 
+ *     The number of recorded accesses, or zero if none have been recorded.
+ */
+uint64_t hsm_get_accesses(int fd);
+
 /**
  * Retrieve the stored atime value from the xattr for a stub file. For stub
  * files this may be different from the real file that was replaced, so the
@@ -155,6 +279,67 @@ int hsm_get_atime(int fd);
  */
 int hsm_get_ctime(int fd);
 
+/**
+ * Retrieve the time at which CloudSM first recorded activity for a file.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose first seen time is
+ *     being retrieved.
+ * 
+ * @return 
+ *     The UNIX timestamp at which the file was first seen, or zero if no
+ *     activity has been recorded.
+ */
+time_t hsm_get_first_seen(int fd);
+
+/**
+ * Retrieve the write generation of a file, which is incremented each time the
+ * file is marked dirty.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose write generation is
+ *     being retrieved.
+ * 
+ * @return 
+ *     The write generation of the file, or zero if it has never been marked
+ *     dirty.
+ */
+uint64_t hsm_get_generation(int fd);
+
+/**
+ * Retrieve the object ID of a file, copying it into the given buffer as a
+ * null-terminated string.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose object ID is being
+ *     retrieved.
+ * 
+ * @param id
+ *     The buffer that will receive the object ID, which must be at least
+ *     HSM_ID_LENGTH + 1 bytes long.
+ * 
+ * @param size
+ *     The size of the buffer, in bytes.
+ * 
+ * @return 
+ *     The length of the object ID, or -1 if the file has no object ID or the
+ *     buffer is too small.
+ */
+ssize_t hsm_get_id(int fd, char* id, size_t size);
+
+/**
+ * Retrieve the time of the most recent access recorded for a file.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose last access time is
+ *     being retrieved.
+ * 
+ * @return 
+ *     The UNIX timestamp of the last recorded access, or zero if no access
+ *     has been recorded.
+ */
+time_t hsm_get_last_access(int fd);
+
 /**
  * Retrieve the stored mtime value from the xattr for a stub file. For stub
  * files this may be different from the real file that was replaced, so the
@@ -169,6 +354,35 @@ int hsm_get_ctime(int fd);
  */
 int hsm_get_mtime(int fd);
 
+/**
+ * Retrieve the number of times the contents of a stub file have been recalled
+ * from the cloud, as recorded by hsm_record_recall().
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose recall count is being
+ *     retrieved.
+ * 
+ * @return 
+ *     The number of recorded recalls, or zero if none have been recorded.
+ */
+uint64_t hsm_get_recalls(int fd);
+
+/**
+ * Retrieve the mask of replicas that hold a given write generation of a file.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose replicas are being
+ *     retrieved.
+ * 
+ * @param gen
+ *     The write generation of the file that the replicas must hold.
+ * 
+ * @return 
+ *     The mask of replicas holding the given generation, with bit 0 for the
+ *     first replica, or zero if none do.
+ */
+uint32_t hsm_get_replicas(int fd, uint64_t gen);
+
 /**
  * Retrieve the stored size value from the xattr for a stub file. For stub
  * files this will be different from the real file that was replaced, so the
@@ -183,6 +397,39 @@ int hsm_get_mtime(int fd);
  */
 ssize_t hsm_get_size(int fd);
 
+/**
+ * Retrieve the name of the storage class that the cloud copy of a file
+ * resides in, copying it into the given buffer as a null-terminated string.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose storage class is being
+ *     retrieved.
+ * 
+ * @param tier
+ *     The buffer that will receive the name of the storage class.
+ * 
+ * @param size
+ *     The size of the buffer, in bytes.
+ * 
+ * @return 
+ *     The length of the storage class name, or -1 if no storage class has
+ *     been recorded or the buffer is too small.
+ */
+ssize_t hsm_get_tier(int fd, char* tier, size_t size);
+
+/**
+ * Retrieve the time that the cloud copy of a file was moved into its current
+ * storage class.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose storage class is being
+ *     checked.
+ * 
+ * @return 
+ *     The time of the move, or zero if it has not been recorded.
+ */
+time_t hsm_get_tier_time(int fd);
+
 /**
  * Returns the status of a file as dirty or clean, zero indicating that the file
  * is clean and its contents are synchronized to the cloud, and non-zero
@@ -224,6 +471,37 @@ int hsm_is_lost(int fd);
  */
 int hsm_is_recalled(int fd);
 
+/**
+ * Returns whether the cloud copy of a file was stored before object IDs were
+ * introduced, and so is still kept under a key made from the path of the
+ * file. That is the case for a file with no object ID that is either a stub,
+ * or a clean file that has been uploaded before. A new file is dirty until
+ * its first upload, which gives it an object ID.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file being checked.
+ * 
+ * @return 
+ *     Non-zero if the cloud copy of the file is stored under its path, or
+ *     zero otherwise.
+ */
+int hsm_is_legacy(int fd);
+
+/**
+ * Returns the status of a file as waiting on an archive restore, zero
+ * indicating that no restore is pending and non-zero indicating that a
+ * restore request has been issued but has not yet completed.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose restore status is being
+ *     checked.
+ * 
+ * @return 
+ *     Zero if no restore is pending, or non-zero if the file is waiting on
+ *     an archive restore.
+ */
+int hsm_is_restoring(int fd);
+
 /**
  * Returns the status of a file as a stub, with zero indicating that the file is
  * not a stub and its contents are expected to be present on the local
@@ -244,6 +522,8 @@ int hsm_is_stub(int fd);
 /**
  * Mark a file as dirty, setting the xattr flag, to indicate that the file
  * contents have been modified on-disk and need to be synchronized to the cloud.
+ * The write generation of the file is incremented as well, and every replica
+ * of the file is marked out of date.
  * 
  * @param fd
  *     The file descriptor pointing to the file whose contents now need to be
@@ -285,6 +565,22 @@ ssize_t hsm_mark_lost(int fd);
  */
 ssize_t hsm_mark_recall(int fd);
 
+/**
+ * Mark a stub file as waiting on an archive restore by setting the
+ * appropriate xattr bit for the file. This indicates that a restore request
+ * has been issued for the cloud copy of the file and that the file cannot be
+ * downloaded until the restore completes.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the stub file whose cloud copy is
+ *     being restored.
+ * 
+ * @return 
+ *     The number of bytes written to the xattr that stores HSM-related flags
+ *     for the file.
+ */
+ssize_t hsm_mark_restore(int fd);
+
 /**
  * Mark a file as a stub, indicating that the contents of the file are being
  * removed from the local filesystem and that only the cloud version of the
@@ -300,13 +596,132 @@ ssize_t hsm_mark_recall(int fd);
  */
 ssize_t hsm_mark_stub(int fd);
 
+/**
+ * Record an access to a file in its access history, incrementing the access
+ * count and updating the last access time. This is used to track how "hot"
+ * a file is when choosing the storage class it should be offloaded to.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file that has been accessed.
+ * 
+ * @return 
+ *     The number of bytes written to the xattr that stores the access
+ *     history, or -1 if an error occurs.
+ */
+ssize_t hsm_record_access(int fd);
+
+/**
+ * Record a recall of a stub file in its access history, incrementing the
+ * recall count. This counts as an access as well.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the stub file that has been recalled.
+ * 
+ * @return 
+ *     The number of bytes written to the xattr that stores the access
+ *     history, or -1 if an error occurs.
+ */
+ssize_t hsm_record_recall(int fd);
+
 ssize_t hsm_set_atime(int fd);
 
 ssize_t hsm_set_ctime(int fd);
 
 ssize_t hsm_set_mtime(int fd);
 
+/**
+ * Generate a new, random object ID without assigning it to any file.
+ * 
+ * @param id
+ *     The buffer that will receive the object ID as a null-terminated string.
+ * 
+ * @param size
+ *     The size of the buffer, in bytes, which must be at least
+ *     HSM_ID_LENGTH + 1.
+ * 
+ * @return 
+ *     The length of the object ID, or -1 if an error occurs.
+ */
+ssize_t hsm_new_id(char* id, size_t size);
+
+/**
+ * Assign a new, random object ID to a file, replacing any ID it already has.
+ * Since nothing has been uploaded under the new ID, the file is marked dirty
+ * and no replica is left marked current. If the file already had an ID, its
+ * write generation is also moved on, as with hsm_mark_dirty(), so that an
+ * upload still running under the old ID leaves the file dirty. A stub is
+ * never given a new ID, as its contents exist only in the object under its
+ * current ID.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file that is being assigned an
+ *     object ID.
+ * 
+ * @return 
+ *     The number of bytes written to the xattr that stores the object ID,
+ *     or -1 if an error occurs, with errno set to EPERM if the file is a
+ *     stub.
+ */
+ssize_t hsm_set_id(int fd);
+
+/**
+ * Record the object ID that the path-based cloud copy of a file has been
+ * moved to. Unlike hsm_set_id(), the file is not marked dirty and its write
+ * generation is left alone, as the object under the new ID already holds the
+ * contents of the file.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose cloud copy was moved.
+ * 
+ * @param id
+ *     The object ID the cloud copy was moved to.
+ * 
+ * @return 
+ *     The number of bytes written to the xattr that stores the object ID,
+ *     or -1 if an error occurs, with errno set to EEXIST if the file
+ *     already has an object ID.
+ */
+ssize_t hsm_set_migrated_id(int fd, const char* id);
+
+/**
+ * Record which replicas hold a given write generation of a file. Nothing is
+ * recorded if the file has been written to since that generation, as the
+ * replicas then hold an out of date copy.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose replicas are being
+ *     recorded.
+ * 
+ * @param gen
+ *     The write generation of the file that was uploaded.
+ * 
+ * @param replicas
+ *     The mask of replicas holding the given generation, with bit 0 for the
+ *     first replica.
+ * 
+ * @return 
+ *     1 if the mask was recorded, 0 if the file has since been written to,
+ *     or -1 if an error occurs.
+ */
+int hsm_set_replicas(int fd, uint64_t gen, uint32_t replicas);
+
 ssize_t hsm_set_size(int fd);
 
+/**
+ * Record the name of the storage class that the cloud copy of a file now
+ * resides in, along with the current time as the time of the move.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose storage class has
+ *     changed.
+ * 
+ * @param tier
+ *     The name of the storage class, for example "GLACIER".
+ * 
+ * @return 
+ *     The number of bytes written to the xattr that stores the storage class.
+ */
+ssize_t hsm_set_tier(int fd, const char* tier);
+
 #endif /* XATTR_H */
 
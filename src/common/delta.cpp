@@ -0,0 +1,421 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/delta.h"
+#include "common/xattr.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <unordered_map>
+
+/**
+ * The magic number at the start of every sidecar signature file.
+ */
+#define DELTA_SIG_MAGIC "CSMSIG02"
+
+/**
+ * The magic number at the start of every patch.
+ */
+#define DELTA_PATCH_MAGIC "CSMPAT01"
+
+/**
+ * The size, in bytes, of the reads made from a file being synchronized.
+ */
+#define DELTA_READ_SIZE (1024 * 1024)
+
+/**
+ * The size, in bytes, of the entity tag field of a sidecar signature file,
+ * including the null terminator.
+ */
+#define DELTA_ETAG_SIZE 128
+
+/**
+ * The header of a sidecar signature file, which is followed by the block
+ * signatures.
+ */
+struct sig_header {
+    char magic[8];
+    char etag[DELTA_ETAG_SIZE];
+    uint64_t block_size;
+    uint64_t size;
+    uint64_t patches;
+    uint64_t patch_bytes;
+    uint64_t count;
+};
+
+/**
+ * The header of a patch, which is followed by the instructions and then the
+ * literal data.
+ */
+struct patch_header {
+    char magic[8];
+    uint64_t block_size;
+    uint64_t size;
+    uint64_t count;
+};
+
+/**
+ * A window onto the contents of a file, filled with pread() as it moves
+ * forward through the file. The file is read rather than mapped, as it may be
+ * the live file, and a writer truncating a mapped file would kill the process
+ * with SIGBUS; a truncated file is instead reported as a short read.
+ */
+struct window {
+
+    /**
+     * Constructor for a window onto the given file.
+     *
+     * @param fd
+     *     The file descriptor of the file.
+     *
+     * @param size
+     *     The size of the file, in bytes; nothing beyond it is read.
+     */
+    window(int fd, size_t size) : fd(fd), size(size), start(0), filled(0),
+            buf(DELTA_READ_SIZE + DELTA_BLOCK_SIZE) {
+    }
+
+    /**
+     * Returns the contents of a range of the file, reading it if it is not
+     * already in the window. Anything before the range is dropped from the
+     * window, and the pointer returned by an earlier call is no longer valid.
+     *
+     * @param offset
+     *     The offset of the range within the file.
+     *
+     * @param length
+     *     The length of the range, in bytes.
+     *
+     * @return
+     *     The contents of the range, or NULL if it could not be read in full.
+     */
+    const uint8_t* at(size_t offset, size_t length) {
+        if (offset >= this->start
+                && offset + length <= this->start + this->filled)
+            return this->buf.data() + (offset - this->start);
+
+        /* Keep whatever has already been read from the offset on. */
+        size_t keep = 0;
+        if (offset >= this->start && offset < this->start + this->filled) {
+            keep = this->start + this->filled - offset;
+            memmove(this->buf.data(), this->buf.data()
+                    + (offset - this->start), keep);
+        }
+        this->start = offset;
+        this->filled = keep;
+        if (this->buf.size() < length)
+            this->buf.resize(length);
+
+        while (this->filled < length) {
+            size_t want = min(this->buf.size() - this->filled,
+                    this->size - (this->start + this->filled));
+            if (want == 0)
+                return NULL;
+            ssize_t got = pread(this->fd, this->buf.data() + this->filled,
+                    want, (off_t) (this->start + this->filled));
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                return NULL;
+            this->filled += (size_t) got;
+        }
+        return this->buf.data();
+    }
+
+    int fd;
+    size_t size;
+    size_t start;
+    size_t filled;
+    vector<uint8_t> buf;
+
+};
+
+delta::delta(string catalog) {
+
+    this->catalog = catalog;
+    this->stats = { 0, 0, 0 };
+
+}
+
+ssize_t delta::sync(s3& target, int fd, int source) {
+    struct stat st;
+    if (fstat(source, &st) != 0)
+        return -1;
+    size_t size = (size_t) st.st_size;
+
+    char id[HSM_ID_LENGTH + 1];
+    if (hsm_get_id(fd, id, sizeof(id)) < 0
+            && (hsm_set_id(fd) < 0 || hsm_get_id(fd, id, sizeof(id)) < 0))
+        return -1;
+    string path = this->catalog + "/" + id + ".sig";
+
+    /* The changes are measured against the last upload even when a full
+     * copy is uploaded, so that the changed byte count is always real. A
+     * file that shrinks while it is read is left for the next pass, as a
+     * write has moved its generation on. */
+    signature old;
+    vector<op> ops;
+    int64_t changed = (int64_t) size;
+    bool loaded = load(path, old) == 0;
+    if (loaded && (changed = diff(source, size, old, ops)) < 0)
+        return -1;
+
+    /* Patches only apply to the full copy the signature was taken from, and
+     * any full upload made elsewhere, for example by a snapshot batch,
+     * replaces that copy and its patches. */
+    bool full = !loaded || old.patches >= DELTA_MAX_PATCHES
+            || old.patch_bytes > size / 2 || old.etag.empty()
+            || target.get_etag(fd) != old.etag;
+
+    ssize_t uploaded = -1;
+    signature sig;
+    if (full) {
+        if (target.upload_file(fd, source) >= 0) {
+            uploaded = (ssize_t) size;
+            sig.etag = target.get_etag(fd);
+            sig.patches = 0;
+            sig.patch_bytes = 0;
+        }
+    }
+    else {
+
+        /* Write the patch to an anonymous file beside the catalog. */
+        int patch = open(this->catalog.c_str(), O_TMPFILE | O_RDWR, 0600);
+        if (patch >= 0) {
+            patch_header header;
+            memcpy(header.magic, DELTA_PATCH_MAGIC, sizeof(header.magic));
+            header.block_size = DELTA_BLOCK_SIZE;
+            header.size = size;
+            header.count = ops.size();
+            bool ok = write(patch, &header, sizeof(header))
+                    == sizeof(header);
+            size_t ops_size = ops.size() * sizeof(op);
+            if (ok && ops_size > 0)
+                ok = write(patch, ops.data(), ops_size) == (ssize_t) ops_size;
+            window in(source, size);
+            for (size_t i = 0; ok && i < ops.size(); i++) {
+                for (uint64_t done = 0; ok && ops[i].source < 0
+                        && done < ops[i].length; ) {
+                    size_t length = (size_t) min<uint64_t>(DELTA_READ_SIZE,
+                            ops[i].length - done);
+                    const uint8_t* data = in.at(ops[i].offset + done, length);
+                    ok = data != NULL
+                            && write(patch, data, length) == (ssize_t) length;
+                    done += length;
+                }
+            }
+
+            off_t patch_size = lseek(patch, 0, SEEK_CUR);
+            if (ok && lseek(patch, 0, SEEK_SET) == 0
+                    && target.upload_patch(fd, (int) old.patches + 1, patch)
+                    >= 0) {
+                uploaded = (ssize_t) patch_size;
+                sig.etag = old.etag;
+                sig.patches = old.patches + 1;
+                sig.patch_bytes = old.patch_bytes + patch_size;
+            }
+            close(patch);
+        }
+    }
+
+    if (uploaded >= 0) {
+        if (sign(source, size, sig) != 0 || save(path, sig) != 0)
+            unlink(path.c_str());
+
+        this->stats.total_bytes += size;
+        this->stats.changed_bytes += changed;
+        this->stats.uploaded_bytes += uploaded;
+        syslog(LOG_INFO, "Synchronized %s: %" PRId64 " of %zu bytes changed "
+                "(%.1f%%), %zd bytes uploaded, %zd bytes saved.", id, changed,
+                size, size ? 100.0 * changed / size : 0.0, uploaded,
+                (ssize_t) size - uploaded);
+    }
+    return uploaded;
+}
+
+delta_stats delta::get_stats() {
+    return this->stats;
+}
+
+int delta::sign(int source, size_t size, signature& sig) {
+    window in(source, size);
+    sig.size = size;
+    sig.blocks.clear();
+    for (size_t offset = 0; offset < size; offset += DELTA_BLOCK_SIZE) {
+        size_t length = min((size_t) DELTA_BLOCK_SIZE, size - offset);
+        const uint8_t* data = in.at(offset, length);
+        if (data == NULL)
+            return -1;
+        block b = { delta_weak(data, length), 0, delta_strong(data, length) };
+        sig.blocks.push_back(b);
+    }
+    return 0;
+}
+
+int64_t delta::diff(int source, size_t size, const signature& sig,
+        vector<op>& ops) {
+
+    /* Only whole blocks can be matched at any offset; a short final block is
+     * only matched at the end of the new file. */
+    unordered_multimap<uint32_t, size_t> index;
+    for (size_t i = 0; i < sig.blocks.size(); i++) {
+        if ((i + 1) * DELTA_BLOCK_SIZE <= sig.size)
+            index.emplace(sig.blocks[i].weak, i);
+    }
+
+    uint64_t literal = 0;
+    auto emit = [&](uint64_t offset, uint64_t length, int64_t source) {
+        if (length == 0)
+            return;
+        if (source < 0)
+            literal += length;
+        if (!ops.empty()) {
+            op& last = ops.back();
+            if (last.offset + last.length == offset
+                    && ((source < 0 && last.source < 0)
+                    || (source >= 0 && last.source >= 0
+                    && last.source + (int64_t) last.length == source))) {
+                last.length += length;
+                return;
+            }
+        }
+        ops.push_back({ offset, length, source });
+    };
+
+    /* Each step needs the block at the current position and the byte after
+     * it, which is rolled into the weak checksum. */
+    window in(source, size);
+    size_t pos = 0;
+    size_t pending = 0;
+    bool fresh = true;
+    uint32_t weak = 0;
+    while (pos + DELTA_BLOCK_SIZE <= size) {
+        const uint8_t* data = in.at(pos, min((size_t) DELTA_BLOCK_SIZE + 1,
+                size - pos));
+        if (data == NULL)
+            return -1;
+        if (fresh) {
+            weak = delta_weak(data, DELTA_BLOCK_SIZE);
+            fresh = false;
+        }
+
+        int64_t match = -1;
+        auto range = index.equal_range(weak);
+        if (range.first != range.second) {
+            uint64_t strong = delta_strong(data, DELTA_BLOCK_SIZE);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (sig.blocks[it->second].strong == strong) {
+                    match = (int64_t) it->second * DELTA_BLOCK_SIZE;
+                    break;
+                }
+            }
+        }
+
+        if (match >= 0) {
+            emit(pending, pos - pending, -1);
+            emit(pos, DELTA_BLOCK_SIZE, match);
+            pos += DELTA_BLOCK_SIZE;
+            pending = pos;
+            fresh = true;
+        }
+        else {
+            if (pos + DELTA_BLOCK_SIZE < size) {
+                weak = delta_roll(weak, DELTA_BLOCK_SIZE, data[0],
+                        data[DELTA_BLOCK_SIZE]);
+            }
+            pos++;
+        }
+    }
+
+    /* The tail of the file may match the short final block. */
+    size_t tail = size - pos;
+    size_t last = sig.blocks.size();
+    if (tail > 0 && pending == pos && last > 0
+            && sig.size - (last - 1) * DELTA_BLOCK_SIZE == tail) {
+        const uint8_t* data = in.at(pos, tail);
+        if (data == NULL)
+            return -1;
+        if (sig.blocks[last - 1].strong == delta_strong(data, tail)) {
+            emit(pos, tail, (int64_t) (last - 1) * DELTA_BLOCK_SIZE);
+            pending = size;
+        }
+    }
+    emit(pending, size - pending, -1);
+    return (int64_t) literal;
+}
+
+int delta::load(const string& path, signature& sig) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    sig_header header;
+    int result = -1;
+    if (read(fd, &header, sizeof(header)) == sizeof(header)
+            && memcmp(header.magic, DELTA_SIG_MAGIC, sizeof(header.magic)) == 0
+            && header.block_size == DELTA_BLOCK_SIZE
+            && header.count == (header.size + DELTA_BLOCK_SIZE - 1)
+                / DELTA_BLOCK_SIZE) {
+        header.etag[DELTA_ETAG_SIZE - 1] = '\0';
+        sig.etag = header.etag;
+        sig.size = header.size;
+        sig.patches = header.patches;
+        sig.patch_bytes = header.patch_bytes;
+        sig.blocks.resize(header.count);
+        ssize_t want = (ssize_t) (header.count * sizeof(block));
+        if (want == 0 || read(fd, sig.blocks.data(), want) == want)
+            result = 0;
+    }
+    close(fd);
+    return result;
+}
+
+int delta::save(const string& path, const signature& sig) {
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (fd < 0)
+        return -1;
+
+    sig_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DELTA_SIG_MAGIC, sizeof(header.magic));
+    snprintf(header.etag, sizeof(header.etag), "%s", sig.etag.c_str());
+    header.block_size = DELTA_BLOCK_SIZE;
+    header.size = sig.size;
+    header.patches = sig.patches;
+    header.patch_bytes = sig.patch_bytes;
+    header.count = sig.blocks.size();
+
+    ssize_t want = (ssize_t) (sig.blocks.size() * sizeof(block));
+    bool ok = write(fd, &header, sizeof(header)) == sizeof(header)
+            && (want == 0 || write(fd, sig.blocks.data(), want) == want)
+            && fsync(fd) == 0;
+    if (close(fd) != 0 || !ok) {
+        unlink(tmp.c_str());
+        return -1;
+    }
+    return rename(tmp.c_str(), path.c_str());
+}
+
+delta::~delta() {
+}
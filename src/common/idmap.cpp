@@ -0,0 +1,181 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/idmap.h"
+#include "common/xattr.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+idmap::idmap(string map_file) {
+
+    this->map_file = map_file;
+
+}
+
+int idmap::load() {
+    this->paths.clear();
+    this->ids.clear();
+
+    FILE* file = fopen(this->map_file.c_str(), "r");
+    if (file == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    /* Each entry is the object ID, inode and path, each null-terminated. */
+    char* fields[3] = { NULL, NULL, NULL };
+    size_t sizes[3] = { 0, 0, 0 };
+    for (;;) {
+        int i;
+        for (i = 0; i < 3; i++) {
+            if (getdelim(&fields[i], &sizes[i], '\0', file) <= 0)
+                break;
+        }
+        if (i < 3)
+            break;
+        ino_t ino = (ino_t) strtoull(fields[1], NULL, 10);
+        this->paths[fields[2]] = { fields[0], ino };
+        this->ids[fields[0]] = ino;
+    }
+    for (char* field : fields)
+        free(field);
+
+    int error = ferror(file);
+    fclose(file);
+    return error ? -1 : 0;
+}
+
+int idmap::save() {
+    string tmp = this->map_file + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "w");
+    if (file == NULL)
+        return -1;
+
+    for (const auto& entry : this->paths) {
+        fprintf(file, "%s%c%llu%c%s%c", entry.second.id.c_str(), '\0',
+                (unsigned long long) entry.second.ino, '\0',
+                entry.first.c_str(), '\0');
+    }
+
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        fclose(file);
+        return -1;
+    }
+    if (fclose(file) != 0)
+        return -1;
+    return ::rename(tmp.c_str(), this->map_file.c_str());
+}
+
+int idmap::add(int fd, string path) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return -1;
+
+    char id[HSM_ID_LENGTH + 1];
+    if (hsm_get_id(fd, id, sizeof(id)) < 0) {
+
+        /* A file from before object IDs keeps its path-based object until
+         * s3::migrate_files() moves it. */
+        if (hsm_is_legacy(fd))
+            return 0;
+        if (hsm_set_id(fd) < 0 || hsm_get_id(fd, id, sizeof(id)) < 0)
+            return -1;
+    }
+    else {
+
+        /* A copy made along with its xattrs needs an object of its own. A
+         * stub is never given a new ID, as its data exists only under the
+         * old one; its inode number has changed because the filesystem was
+         * restored or received, or the map was rebuilt. */
+        auto known = this->ids.find(id);
+        if (known != this->ids.end() && known->second != st.st_ino
+                && !hsm_is_stub(fd)) {
+            if (hsm_set_id(fd) < 0 || hsm_get_id(fd, id, sizeof(id)) < 0)
+                return -1;
+        }
+    }
+
+    auto old = this->paths.find(path);
+    if (old != this->paths.end() && old->second.id != id)
+        this->ids.erase(old->second.id);
+    this->paths[path] = { id, st.st_ino };
+    this->ids[id] = st.st_ino;
+    return 0;
+}
+
+string idmap::lookup(string path) {
+    auto entry = this->paths.find(path);
+    if (entry == this->paths.end())
+        return "";
+    return entry->second.id;
+}
+
+size_t idmap::rename(string from, string to) {
+    vector<pair<string, record>> moved;
+
+    auto entry = this->paths.find(from);
+    if (entry != this->paths.end()) {
+        moved.emplace_back(to, entry->second);
+        this->paths.erase(entry);
+    }
+
+    auto range = this->subtree(from);
+    for (auto it = range.first; it != range.second; ++it)
+        moved.emplace_back(to + it->first.substr(from.size()), it->second);
+    this->paths.erase(range.first, range.second);
+
+    for (auto& m : moved) {
+        auto replaced = this->paths.find(m.first);
+        if (replaced != this->paths.end()
+                && replaced->second.id != m.second.id)
+            this->ids.erase(replaced->second.id);
+        this->paths[m.first] = m.second;
+    }
+    return moved.size();
+}
+
+size_t idmap::remove(string path) {
+    size_t removed = 0;
+
+    auto entry = this->paths.find(path);
+    if (entry != this->paths.end()) {
+        this->ids.erase(entry->second.id);
+        this->paths.erase(entry);
+        removed++;
+    }
+
+    auto range = this->subtree(path);
+    for (auto it = range.first; it != range.second; ++it) {
+        this->ids.erase(it->second.id);
+        removed++;
+    }
+    this->paths.erase(range.first, range.second);
+    return removed;
+}
+
+pair<map<string, idmap::record>::iterator, map<string, idmap::record>::iterator>
+        idmap::subtree(const string& path) {
+
+    /* Everything beneath "dir/" sorts before "dir0", as '0' follows '/'. */
+    return make_pair(this->paths.lower_bound(path + "/"),
+            this->paths.lower_bound(path + "0"));
+}
+
+idmap::~idmap() {
+}
@@ -0,0 +1,782 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/jobs.h"
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+/**
+ * The layout version of the job table. It is part of the name of the shared
+ * memory, so that processes built with different layouts never attach to the
+ * same table.
+ */
+#define JOBS_VERSION 3
+
+/**
+ * The magic number at the start of the shared memory.
+ */
+#define JOBS_MAGIC "CSMJOB03"
+
+/**
+ * The directory that POSIX shared memory objects live in.
+ */
+#define JOBS_SHM_DIR "/dev/shm"
+
+/**
+ * The number of shards the job table is split into. This must be a power of
+ * two.
+ */
+#define JOBS_SHARDS 64
+
+/**
+ * The number of leases each shard can hold. This must be a power of two.
+ */
+#define JOBS_SHARD_SLOTS 4096
+
+/**
+ * The largest number of leases a shard will hold. Claims of new files are
+ * refused beyond this, so that probe sequences stay short.
+ */
+#define JOBS_SHARD_MAX_LEASES (JOBS_SHARD_SLOTS / 8 * 7)
+
+/**
+ * The number of jobs the queue can hold. This must be a power of two.
+ */
+#define JOBS_QUEUE_SIZE 65536
+
+/**
+ * The number of jobs that can be taken from the queue but not yet
+ * acknowledged at once.
+ */
+#define JOBS_TAKEN_SIZE 1024
+
+/**
+ * The longest time, in milliseconds, that pop() waits while jobs are taken
+ * before checking whether any of them should be put back on the queue.
+ */
+#define JOBS_SWEEP_MS 1000
+
+/**
+ * The thread that holds a lease or a taken job.
+ */
+struct holder {
+    uint32_t pid;
+    uint32_t tid;
+};
+
+/**
+ * A lease on a single file. A slot whose inode number is zero is empty.
+ */
+struct lease {
+    uint64_t ino;
+    uint64_t expires;
+    holder owner;
+    uint32_t kind;
+};
+
+/**
+ * A shard of the job table: an open-addressed hash table of leases, keyed by
+ * inode number, with linear probing.
+ */
+struct shard {
+    pthread_mutex_t lock;
+    uint32_t count;
+    lease slots[JOBS_SHARD_SLOTS];
+};
+
+/**
+ * A single queued job.
+ */
+struct job {
+    uint64_t ino;
+    uint32_t kind;
+};
+
+/**
+ * A job taken from the queue but not yet acknowledged, which is put back on
+ * the queue if its holder dies or the lease on it expires. A slot whose inode
+ * number is zero is empty.
+ */
+struct taken_job {
+    job j;
+    uint64_t expires;
+    holder owner;
+};
+
+/**
+ * The queue of jobs, a ring buffer. Consumers wait on the futex, which is
+ * incremented each time a job is pushed.
+ */
+struct queue {
+    pthread_mutex_t lock;
+    atomic<uint32_t> futex;
+    uint64_t head;
+    uint64_t tail;
+    uint32_t taken_count;
+    job jobs[JOBS_QUEUE_SIZE];
+    taken_job taken[JOBS_TAKEN_SIZE];
+};
+
+struct jobs::table {
+    char magic[8];
+    shard shards[JOBS_SHARDS];
+    queue pending;
+};
+
+/**
+ * Returns the current time, in nanoseconds, on a clock that is shared by all
+ * processes and keeps counting while the system is suspended.
+ *
+ * @return
+ *     The current time, in nanoseconds.
+ */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Mix the bits of an inode number, so that inodes allocated in sequence are
+ * spread across shards and slots.
+ *
+ * @param ino
+ *     The inode number.
+ *
+ * @return
+ *     The hash of the inode number.
+ */
+static uint64_t hash_ino(uint64_t ino) {
+    ino ^= ino >> 33;
+    ino *= 0xff51afd7ed558ccdull;
+    ino ^= ino >> 33;
+    ino *= 0xc4ceb9fe1a85ec53ull;
+    ino ^= ino >> 33;
+    return ino;
+}
+
+/**
+ * Wait on a futex in shared memory until its value changes from the given
+ * value, it is woken, or the timeout passes.
+ *
+ * @param futex
+ *     The futex to wait on.
+ *
+ * @param value
+ *     The value the futex is expected to hold.
+ *
+ * @param timeout_ms
+ *     The longest time, in milliseconds, to wait, or -1 to wait indefinitely.
+ */
+static void futex_wait(atomic<uint32_t>* futex, uint32_t value,
+        int timeout_ms) {
+    struct timespec ts;
+    struct timespec* timeout = NULL;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long) (timeout_ms % 1000) * 1000000;
+        timeout = &ts;
+    }
+    syscall(SYS_futex, (uint32_t*) futex, FUTEX_WAIT, value, timeout, NULL, 0);
+}
+
+/**
+ * Wake every process waiting on a futex in shared memory.
+ *
+ * @param futex
+ *     The futex to wake.
+ */
+static void futex_wake(atomic<uint32_t>* futex) {
+    syscall(SYS_futex, (uint32_t*) futex, FUTEX_WAKE, INT32_MAX, NULL, NULL,
+            0);
+}
+
+/**
+ * Initialize a mutex in shared memory so that it can be used by every
+ * attached process, and recovered if its owner dies while holding it.
+ *
+ * @param lock
+ *     The mutex to initialize.
+ */
+static void init_lock(pthread_mutex_t* lock) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+
+/**
+ * Returns the calling thread, as the holder of a lease.
+ *
+ * @return
+ *     The process and thread IDs of the calling thread.
+ */
+static holder self() {
+    holder h = { (uint32_t) getpid(), (uint32_t) syscall(SYS_gettid) };
+    return h;
+}
+
+/**
+ * Returns whether two holders are the same thread.
+ *
+ * @param a
+ *     The first holder.
+ *
+ * @param b
+ *     The second holder.
+ *
+ * @return
+ *     True if both are the same thread, false otherwise.
+ */
+static bool same_holder(const holder& a, const holder& b) {
+    return a.pid == b.pid && a.tid == b.tid;
+}
+
+/**
+ * Returns whether a lease is still held, that is, whether it has not expired
+ * and the thread holding it is still running.
+ *
+ * @param owner
+ *     The thread holding the lease.
+ *
+ * @param expires
+ *     The time, in nanoseconds, that the lease expires.
+ *
+ * @param now
+ *     The current time, in nanoseconds.
+ *
+ * @return
+ *     True if the lease is still held, false if it may be taken over.
+ */
+static bool is_held(const holder& owner, uint64_t expires, uint64_t now) {
+    if (expires <= now)
+        return false;
+    return syscall(SYS_tgkill, (pid_t) owner.pid, (pid_t) owner.tid, 0) == 0
+            || errno != ESRCH;
+}
+
+/**
+ * Find the slot holding the lease for an inode in a shard, or the empty slot
+ * where it would be inserted. The shard must be locked.
+ *
+ * @param s
+ *     The shard to search.
+ *
+ * @param ino
+ *     The inode number.
+ *
+ * @return
+ *     The index of the slot, or -1 if the inode is not present and the shard
+ *     is full.
+ */
+static long find_slot(shard* s, uint64_t ino) {
+    size_t mask = JOBS_SHARD_SLOTS - 1;
+    size_t i = (size_t) (hash_ino(ino) / JOBS_SHARDS) & mask;
+    for (size_t n = 0; n < JOBS_SHARD_SLOTS; n++, i = (i + 1) & mask) {
+        if (s->slots[i].ino == ino || s->slots[i].ino == 0)
+            return (long) i;
+    }
+    return -1;
+}
+
+/**
+ * Remove the lease in the given slot of a shard, moving back any leases
+ * further along the probe sequence so that they can still be found. The
+ * shard must be locked.
+ *
+ * @param s
+ *     The shard to remove the lease from.
+ *
+ * @param i
+ *     The index of the slot holding the lease.
+ */
+static void remove_slot(shard* s, size_t i) {
+    size_t mask = JOBS_SHARD_SLOTS - 1;
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (s->slots[j].ino == 0)
+            break;
+        size_t home = (size_t) (hash_ino(s->slots[j].ino) / JOBS_SHARDS)
+                & mask;
+
+        /* Leave the lease where it is if its home lies after the hole. */
+        if (((j - home) & mask) < ((j - i) & mask))
+            continue;
+        s->slots[i] = s->slots[j];
+        i = j;
+    }
+    s->slots[i].ino = 0;
+    s->count--;
+}
+
+/**
+ * Rebuild a shard after a process died while holding its lock, which may
+ * have left a lease duplicated part way through remove_slot() and the count
+ * of leases out of date. The shard must be locked.
+ *
+ * @param s
+ *     The shard to rebuild.
+ */
+static void repair_shard(shard* s) {
+    vector<lease> leases;
+    for (lease& l : s->slots) {
+        if (l.ino != 0)
+            leases.push_back(l);
+        l.ino = 0;
+    }
+    s->count = 0;
+    for (const lease& l : leases) {
+        long i = find_slot(s, l.ino);
+        if (i >= 0 && s->slots[i].ino == 0) {
+            s->slots[i] = l;
+            s->count++;
+        }
+    }
+}
+
+/**
+ * Take the lock of a shard, rebuilding the shard if the process that held
+ * the lock died.
+ *
+ * @param s
+ *     The shard to lock.
+ */
+static void lock_shard(shard* s) {
+    if (pthread_mutex_lock(&s->lock) == EOWNERDEAD) {
+        repair_shard(s);
+        pthread_mutex_consistent(&s->lock);
+    }
+}
+
+/**
+ * Take the lock of the queue, recounting the taken jobs if the process that
+ * held the lock died. A process that dies between recording a taken job and
+ * advancing the head of the queue, or between putting a taken job back and
+ * clearing it, leaves the job both queued and taken, so it may be handed out
+ * twice; that is harmless, as every job is claimed before it is worked on.
+ *
+ * @param q
+ *     The queue to lock.
+ */
+static void lock_queue(queue* q) {
+    if (pthread_mutex_lock(&q->lock) == EOWNERDEAD) {
+        q->taken_count = 0;
+        for (const taken_job& t : q->taken) {
+            if (t.j.ino != 0)
+                q->taken_count++;
+        }
+        pthread_mutex_consistent(&q->lock);
+    }
+}
+
+/**
+ * Release every lease in a shard that is held by a thread that has exited
+ * or that has expired. The shard must be locked.
+ *
+ * @param s
+ *     The shard to reap.
+ *
+ * @param now
+ *     The current time, in nanoseconds.
+ *
+ * @return
+ *     The number of leases released.
+ */
+static size_t reap_shard(shard* s, uint64_t now) {
+    size_t released = 0;
+    for (size_t i = 0; i < JOBS_SHARD_SLOTS; ) {
+
+        /* Removal shifts a later lease into this slot, so check it again
+         * before moving on. */
+        if (s->slots[i].ino != 0
+                && !is_held(s->slots[i].owner, s->slots[i].expires, now)) {
+            remove_slot(s, i);
+            released++;
+        }
+        else
+            i++;
+    }
+    return released;
+}
+
+/**
+ * Returns the shard that holds the lease for an inode.
+ *
+ * @param shards
+ *     The shards of the job table.
+ *
+ * @param ino
+ *     The inode number.
+ *
+ * @return
+ *     The shard for the inode.
+ */
+static shard* shard_for(shard* shards, uint64_t ino) {
+    return &shards[hash_ino(ino) & (JOBS_SHARDS - 1)];
+}
+
+/**
+ * Add a job to the end of the queue. The queue must be locked.
+ *
+ * @param q
+ *     The queue.
+ *
+ * @param ino
+ *     The inode number of the file.
+ *
+ * @param kind
+ *     The kind of work to be done on the file.
+ *
+ * @return
+ *     Zero on success, or -1 if the queue is full.
+ */
+static int enqueue(queue* q, uint64_t ino, uint32_t kind) {
+    if (q->tail - q->head >= JOBS_QUEUE_SIZE)
+        return -1;
+    job& j = q->jobs[q->tail & (JOBS_QUEUE_SIZE - 1)];
+    j.ino = ino;
+    j.kind = kind;
+    q->tail++;
+    q->futex.fetch_add(1);
+    return 0;
+}
+
+/**
+ * Put back on the queue every job taken by a thread that has exited, or whose
+ * lease has expired, without being acknowledged. The queue must be locked.
+ *
+ * @param q
+ *     The queue.
+ *
+ * @param now
+ *     The current time, in nanoseconds.
+ *
+ * @return
+ *     The number of jobs put back.
+ */
+static size_t requeue_taken(queue* q, uint64_t now) {
+    size_t requeued = 0;
+    for (taken_job& t : q->taken) {
+        if (t.j.ino != 0 && !is_held(t.owner, t.expires, now)
+                && enqueue(q, t.j.ino, t.j.kind) == 0) {
+            t.j.ino = 0;
+            q->taken_count--;
+            requeued++;
+        }
+    }
+    return requeued;
+}
+
+jobs::jobs(dev_t dev) {
+
+    this->shared = NULL;
+
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s/cloudsm.jobs.v%d.%llx", JOBS_SHM_DIR,
+            JOBS_VERSION, (unsigned long long) dev);
+
+    int fd = open(name, O_RDWR | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT)
+        fd = create(name);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == sizeof(table)) {
+        map = mmap(NULL, sizeof(table), PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    table* t = (table*) map;
+    if (memcmp(t->magic, JOBS_MAGIC, sizeof(t->magic)) != 0) {
+        munmap(map, sizeof(table));
+        return;
+    }
+    this->shared = t;
+
+}
+
+int jobs::create(const char* name) {
+
+    /* The table is set up in an anonymous file and only then linked into
+     * place, so that no process ever attaches to a table that is half set
+     * up, and a process that dies while setting one up leaves nothing
+     * behind. */
+    int fd = open(JOBS_SHM_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, sizeof(table)) == 0) {
+        map = mmap(NULL, sizeof(table), PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    table* t = (table*) map;
+    for (shard& s : t->shards)
+        init_lock(&s.lock);
+    init_lock(&t->pending.lock);
+    memcpy(t->magic, JOBS_MAGIC, sizeof(t->magic));
+    munmap(map, sizeof(table));
+
+    /* If another process linked its table first, use that one instead. */
+    string link = "/proc/self/fd/" + to_string(fd);
+    if (linkat(AT_FDCWD, link.c_str(), AT_FDCWD, name, AT_SYMLINK_FOLLOW)
+            == 0)
+        return fd;
+    int error = errno;
+    close(fd);
+    return error == EEXIST ? open(name, O_RDWR | O_CLOEXEC) : -1;
+
+}
+
+bool jobs::is_attached() {
+    return this->shared != NULL;
+}
+
+int jobs::claim(ino_t ino, int kind, int ttl) {
+    if (this->shared == NULL || ino == 0)
+        return -1;
+
+    shard* s = shard_for(this->shared->shards, ino);
+    holder me = self();
+    uint64_t now = now_ns();
+    int result = 1;
+
+    lock_shard(s);
+    long i = find_slot(s, ino);
+
+    /* Make room in a full shard by clearing out leases nobody holds. */
+    if (i >= 0 && s->slots[i].ino == 0 && s->count >= JOBS_SHARD_MAX_LEASES
+            && reap_shard(s, now) > 0)
+        i = find_slot(s, ino);
+    if (i < 0 || (s->slots[i].ino == 0 && s->count >= JOBS_SHARD_MAX_LEASES))
+        result = -1;
+    else if (s->slots[i].ino == ino && !same_holder(s->slots[i].owner, me)
+            && is_held(s->slots[i].owner, s->slots[i].expires, now))
+        result = 0;
+    else {
+        lease& l = s->slots[i];
+        if (l.ino == 0)
+            s->count++;
+        l.expires = now + (uint64_t) ttl * 1000000000ull;
+        l.owner = me;
+        l.kind = (uint32_t) kind;
+        l.ino = ino;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return result;
+}
+
+int jobs::renew(ino_t ino, int ttl) {
+    if (this->shared == NULL || ino == 0)
+        return -1;
+
+    shard* s = shard_for(this->shared->shards, ino);
+    int result = -1;
+
+    lock_shard(s);
+    long i = find_slot(s, ino);
+    if (i >= 0 && s->slots[i].ino == ino
+            && same_holder(s->slots[i].owner, self())) {
+        s->slots[i].expires = now_ns() + (uint64_t) ttl * 1000000000ull;
+        result = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return result;
+}
+
+int jobs::release(ino_t ino) {
+    if (this->shared == NULL || ino == 0)
+        return -1;
+
+    shard* s = shard_for(this->shared->shards, ino);
+    int result = -1;
+
+    lock_shard(s);
+    long i = find_slot(s, ino);
+    if (i >= 0 && s->slots[i].ino == ino
+            && same_holder(s->slots[i].owner, self())) {
+        remove_slot(s, (size_t) i);
+        result = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return result;
+}
+
+int jobs::push(ino_t ino, int kind) {
+    if (this->shared == NULL)
+        return -1;
+
+    queue* q = &this->shared->pending;
+    int result = -1;
+
+    lock_queue(q);
+    result = enqueue(q, ino, kind);
+    pthread_mutex_unlock(&q->lock);
+
+    if (result == 0)
+        futex_wake(&q->futex);
+    return result;
+}
+
+int jobs::pop(ino_t* ino, int* kind, int timeout_ms) {
+    if (this->shared == NULL)
+        return -1;
+
+    queue* q = &this->shared->pending;
+    uint64_t deadline = timeout_ms < 0 ? UINT64_MAX
+            : now_ns() + (uint64_t) timeout_ms * 1000000ull;
+
+    for (;;) {
+        uint32_t seen = q->futex.load();
+
+        /* Jobs taken by threads that have since exited are put back whenever
+         * there is nothing else to take. */
+        lock_queue(q);
+        size_t requeued = 0;
+        if (q->head == q->tail || q->taken_count >= JOBS_TAKEN_SIZE)
+            requeued = requeue_taken(q, now_ns());
+
+        /* The job stays recorded against this thread until it is
+         * acknowledged, so that it is not lost if this process dies first. */
+        if (q->head != q->tail && q->taken_count < JOBS_TAKEN_SIZE) {
+            taken_job* t = q->taken;
+            while (t->j.ino != 0)
+                t++;
+            t->j = q->jobs[q->head & (JOBS_QUEUE_SIZE - 1)];
+            t->expires = now_ns() + (uint64_t) JOB_LEASE_TTL * 1000000000ull;
+            t->owner = self();
+            q->taken_count++;
+            q->head++;
+            *ino = (ino_t) t->j.ino;
+            *kind = (int) t->j.kind;
+            pthread_mutex_unlock(&q->lock);
+            if (requeued > 1)
+                futex_wake(&q->futex);
+            return 1;
+        }
+        bool sweep = q->taken_count > 0;
+        pthread_mutex_unlock(&q->lock);
+
+        /* While jobs are taken, wake up now and then to check on them. */
+        uint64_t now = now_ns();
+        if (now >= deadline)
+            return 0;
+        int wait_ms = deadline == UINT64_MAX ? -1
+                : (int) ((deadline - now + 999999) / 1000000);
+        if (sweep && (wait_ms < 0 || wait_ms > JOBS_SWEEP_MS))
+            wait_ms = JOBS_SWEEP_MS;
+        futex_wait(&q->futex, seen, wait_ms);
+    }
+}
+
+int jobs::ack(ino_t ino) {
+    if (this->shared == NULL || ino == 0)
+        return -1;
+
+    queue* q = &this->shared->pending;
+    holder me = self();
+    int result = -1;
+
+    lock_queue(q);
+    for (taken_job& t : q->taken) {
+        if (t.j.ino == ino && same_holder(t.owner, me)) {
+            t.j.ino = 0;
+            q->taken_count--;
+            q->futex.fetch_add(1);
+            result = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    /* Wake any pop() waiting for a free slot in the taken jobs. */
+    if (result == 0)
+        futex_wake(&q->futex);
+    return result;
+}
+
+size_t jobs::reap() {
+    if (this->shared == NULL)
+        return 0;
+
+    uint64_t now = now_ns();
+
+    queue* q = &this->shared->pending;
+    lock_queue(q);
+    size_t requeued = requeue_taken(q, now);
+    pthread_mutex_unlock(&q->lock);
+    if (requeued > 0)
+        futex_wake(&q->futex);
+
+    size_t released = requeued;
+    for (shard& s : this->shared->shards) {
+        lock_shard(&s);
+        released += reap_shard(&s, now);
+        pthread_mutex_unlock(&s.lock);
+    }
+    return released;
+}
+
+jobs::~jobs() {
+
+    if (this->shared == NULL)
+        return;
+
+    uint32_t pid = (uint32_t) getpid();
+    for (shard& s : this->shared->shards) {
+        lock_shard(&s);
+        for (size_t i = 0; i < JOBS_SHARD_SLOTS; ) {
+            if (s.slots[i].ino != 0 && s.slots[i].owner.pid == pid)
+                remove_slot(&s, i);
+            else
+                i++;
+        }
+        pthread_mutex_unlock(&s.lock);
+    }
+    munmap(this->shared, sizeof(table));
+
+}
@@ -0,0 +1,319 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/replicas.h"
+#include "common/xattr.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+/**
+ * The shortest time, in milliseconds, to wait for a replica to answer before
+ * a backup request is sent to the next one.
+ */
+#define REPLICA_MIN_HEDGE_MS 20.0
+
+/**
+ * The weight given to each new response time in a replica's moving average.
+ */
+#define REPLICA_LATENCY_WEIGHT 0.2
+
+/**
+ * The response time, in milliseconds, counted for a replica when it fails to
+ * answer, so that a replica that keeps failing sinks to the back of the
+ * order rather than keeping the average of its last success.
+ */
+#define REPLICA_FAILURE_MS 10000.0
+
+/**
+ * The size, in bytes, that larger parts are rounded up to a multiple of.
+ */
+#define REPLICA_PART_ALIGN (1024 * 1024)
+
+/**
+ * A buffer of file data that is shared between the replicas being uploaded
+ * to, and released once every replica has sent it.
+ */
+struct chunk {
+
+    /**
+     * The data read from the file.
+     */
+    vector<char> data;
+
+    /**
+     * The number of bytes of data read.
+     */
+    size_t size;
+
+    /**
+     * The offset within the file that the data was read from.
+     */
+    off_t offset;
+
+};
+
+/**
+ * The state of a set of lookups sent to the replicas during a recall, which
+ * is shared with any lookups still running once the recall has finished.
+ */
+struct lookup {
+
+    /**
+     * The lock guarding the state.
+     */
+    mutex lock;
+
+    /**
+     * Signalled each time a lookup answers.
+     */
+    condition_variable answered;
+
+    /**
+     * The index of the first replica to find the file, or -1 if none has.
+     */
+    int winner = -1;
+
+    /**
+     * The number of lookups that have not yet answered.
+     */
+    size_t outstanding = 0;
+
+};
+
+replicas::replicas(vector<s3> targets) {
+
+    if (targets.size() > REPLICA_MAX)
+        targets.resize(REPLICA_MAX);
+    this->targets = targets;
+    this->latency = make_shared<latencies>();
+    this->latency->ms.assign(this->targets.size(), 0.0);
+
+}
+
+ssize_t replicas::upload_file(int fd, int source, uint64_t gen) {
+    struct stat st;
+    if (fstat(source, &st) != 0)
+        return -1;
+
+    uint32_t done = hsm_get_replicas(fd, gen);
+    uint32_t all = (uint32_t) ((1ull << this->targets.size()) - 1);
+    vector<size_t> pending;
+    for (size_t i = 0; i < this->targets.size(); i++) {
+        if (!(done & (1u << i)) && this->targets[i].upload_begin(fd) == 0)
+            pending.push_back(i);
+    }
+    if (pending.empty())
+        return (done & all) == all ? (ssize_t) st.st_size : -1;
+
+    /* Keep large files within the part limit of a multipart upload. */
+    size_t part_size = REPLICA_CHUNK_SIZE;
+    size_t needed = (size_t) st.st_size / REPLICA_MAX_PARTS + 1;
+    if (needed > part_size) {
+        part_size = (needed + REPLICA_PART_ALIGN - 1) / REPLICA_PART_ALIGN
+                * REPLICA_PART_ALIGN;
+    }
+
+    /* The buffers read but not yet sent by every replica, and how far each
+     * replica has got through them. */
+    mutex lock;
+    condition_variable changed;
+    deque<shared_ptr<chunk>> window;
+    size_t base = 0;
+    bool eof = false;
+    bool read_failed = false;
+    size_t active = pending.size();
+    vector<size_t> next(pending.size(), 0);
+    vector<bool> failed(pending.size(), false);
+
+    /* Drop buffers that every replica still uploading has sent. */
+    auto trim = [&]() {
+        size_t low = SIZE_MAX;
+        for (size_t j = 0; j < pending.size(); j++) {
+            if (!failed[j])
+                low = min(low, next[j]);
+        }
+        while (!window.empty() && base < low) {
+            window.pop_front();
+            base++;
+        }
+    };
+
+    vector<thread> senders;
+    for (size_t j = 0; j < pending.size(); j++) {
+        senders.emplace_back([&, j]() {
+            s3& target = this->targets[pending[j]];
+            unique_lock<mutex> guard(lock);
+            for (;;) {
+                changed.wait(guard, [&]() {
+                    return next[j] < base + window.size() || eof;
+                });
+                if (next[j] >= base + window.size())
+                    break;
+                shared_ptr<chunk> c = window[next[j] - base];
+                guard.unlock();
+                ssize_t sent = target.upload_part(fd, c->data.data(), c->size,
+                        c->offset);
+                guard.lock();
+                if (sent != (ssize_t) c->size) {
+                    failed[j] = true;
+                    active--;
+                    trim();
+                    changed.notify_all();
+                    break;
+                }
+                next[j]++;
+                trim();
+                changed.notify_all();
+            }
+        });
+    }
+
+    /* An empty file is still sent as a single empty part, as a multipart
+     * upload cannot be completed without any parts. */
+    off_t offset = 0;
+    size_t parts = 0;
+    for (;;) {
+        auto c = make_shared<chunk>();
+        c->data.resize(part_size);
+        ssize_t got = pread(source, c->data.data(), part_size, offset);
+        unique_lock<mutex> guard(lock);
+        if (got < 0 || (got == 0 && parts > 0) || active == 0) {
+            read_failed = got < 0;
+            eof = true;
+            changed.notify_all();
+            break;
+        }
+        c->size = (size_t) got;
+        c->offset = offset;
+        offset += got;
+        changed.wait(guard, [&]() {
+            return window.size() < REPLICA_WINDOW || active == 0;
+        });
+        window.push_back(c);
+        parts++;
+        changed.notify_all();
+    }
+
+    for (thread& sender : senders)
+        sender.join();
+
+    for (size_t j = 0; j < pending.size(); j++) {
+        bool ok = !failed[j] && !read_failed;
+        if (this->targets[pending[j]].upload_end(fd, ok) == 0 && ok)
+            done |= 1u << pending[j];
+    }
+
+    /* A write made during the upload leaves the new mask unrecorded, and
+     * the old one no longer applies. */
+    if (hsm_set_replicas(fd, gen, done) != 1)
+        return -1;
+    return (done & all) == all ? (ssize_t) offset : -1;
+}
+
+ssize_t replicas::download_file(int fd) {
+    vector<size_t> order = this->by_latency();
+    if (order.empty())
+        return -1;
+
+    /* Each lookup works on its own copy of the target, a duplicate of the
+     * file descriptor and the shared state, so that lookups which are slow
+     * to answer can be left running once the file has been downloaded. */
+    shared_ptr<lookup> state = make_shared<lookup>();
+    shared_ptr<latencies> stats = this->latency;
+    auto probe = [state, stats](s3 target, size_t index, int dup_fd) {
+        auto start = chrono::steady_clock::now();
+        ssize_t size = target.stat_object(dup_fd);
+        chrono::duration<double, milli> ms = chrono::steady_clock::now()
+                - start;
+        close(dup_fd);
+        observe(*stats, index, size >= 0 ? ms.count()
+                : max(ms.count(), REPLICA_FAILURE_MS));
+        lock_guard<mutex> guard(state->lock);
+        if (size >= 0 && state->winner < 0)
+            state->winner = (int) index;
+        state->outstanding--;
+        state->answered.notify_all();
+    };
+
+    /* Send a lookup to the fastest replica, with a backup to the next one
+     * each time the last has taken twice as long as usual to answer. */
+    unique_lock<mutex> guard(state->lock);
+    for (size_t i = 0; i < order.size() && state->winner < 0; i++) {
+        int dup_fd = dup(fd);
+        if (dup_fd < 0)
+            break;
+        state->outstanding++;
+        thread(probe, this->targets[order[i]], order[i], dup_fd).detach();
+        double hedge;
+        {
+            lock_guard<mutex> averages(stats->lock);
+            hedge = max(REPLICA_MIN_HEDGE_MS, 2 * stats->ms[order[i]]);
+        }
+        state->answered.wait_for(guard,
+                chrono::duration<double, milli>(hedge), [&]() {
+            return state->winner >= 0 || state->outstanding == 0;
+        });
+    }
+    state->answered.wait(guard, [&]() {
+        return state->winner >= 0 || state->outstanding == 0;
+    });
+    int first = state->winner;
+    guard.unlock();
+
+    /* Download from the first to answer, then fail over to the others. */
+    ssize_t result = -1;
+    if (first >= 0) {
+        result = this->targets[first].download_file(fd);
+        if (result < 0)
+            observe(*stats, first, REPLICA_FAILURE_MS);
+        for (size_t i = 0; result < 0 && i < order.size(); i++) {
+            if ((int) order[i] != first)
+                result = this->targets[order[i]].download_file(fd);
+        }
+    }
+    return result;
+}
+
+size_t replicas::size() {
+    return this->targets.size();
+}
+
+void replicas::observe(latencies& stats, size_t index, double ms) {
+    lock_guard<mutex> guard(stats.lock);
+    double& avg = stats.ms[index];
+    avg = avg == 0.0 ? ms : avg + REPLICA_LATENCY_WEIGHT * (ms - avg);
+}
+
+vector<size_t> replicas::by_latency() {
+    vector<size_t> order;
+    for (size_t i = 0; i < this->targets.size(); i++)
+        order.push_back(i);
+    lock_guard<mutex> guard(this->latency->lock);
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return this->latency->ms[a] < this->latency->ms[b];
+    });
+    return order;
+}
+
+replicas::~replicas() {
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/restore.h"
+#include "common/xattr.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <syslog.h>
+#include <unistd.h>
+
+/**
+ * Answer a fanotify permission event, logging any failure to do so, since the
+ * process that triggered the event stays blocked until it is answered.
+ *
+ * @param fan_fd
+ *     The fanotify file descriptor the permission event was read from.
+ *
+ * @param fd
+ *     The file descriptor of the file the event was for.
+ *
+ * @param allow
+ *     Whether access to the file should be allowed.
+ */
+static void respond(int fan_fd, int fd, bool allow) {
+    struct fanotify_response response = {
+        fd, (uint32_t) (allow ? FAN_ALLOW : FAN_DENY)
+    };
+    if (write(fan_fd, &response, sizeof(response)) != sizeof(response))
+        syslog(LOG_ERR, "Unable to answer permission event: %s",
+                strerror(errno));
+}
+
+/**
+ * Retrieve the path of an open file, for use in log messages.
+ *
+ * @param fd
+ *     The file descriptor of the file.
+ *
+ * @return
+ *     The path of the file, or a description of the file descriptor if the
+ *     path cannot be determined.
+ */
+static string fd_path(int fd) {
+    char link[64];
+    char path[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t length = readlink(link, path, sizeof(path) - 1);
+    if (length < 0)
+        return "fd " + to_string(fd);
+    path[length] = '\0';
+    return path;
+}
+
+restore_queue::restore_queue(s3& target, int days)
+        : target(target), days(days) {
+}
+
+void restore_queue::add(int fd, int fan_fd, bool hold) {
+    recall r = { fd, -1 };
+    if (fan_fd >= 0 && !hold) {
+        respond(fan_fd, fd, false);
+        syslog(LOG_NOTICE, "%s is being restored from archive storage and "
+                "will be available later.", fd_path(fd).c_str());
+    }
+    else
+        r.fan_fd = fan_fd;
+    hsm_mark_recall(fd);
+    this->queued.push_back(r);
+}
+
+int restore_queue::flush() {
+    if (this->queued.empty())
+        return 0;
+
+    vector<int> fds;
+    for (const recall& r : this->queued)
+        fds.push_back(r.fd);
+
+    vector<int> results;
+    int issued = this->target.restore_files(fds, this->days, results);
+
+    /* Each file is handled on its own, so that one object that cannot be
+     * restored does not hold up the rest of the batch. */
+    vector<recall> retry;
+    for (size_t i = 0; i < this->queued.size(); i++) {
+        recall r = this->queued[i];
+        int error = i < results.size() ? results[i] : EIO;
+        if (error == 0) {
+            hsm_mark_restore(r.fd);
+            this->requested.push_back(r);
+        }
+        else if (error == ENOENT) {
+            syslog(LOG_ERR, "The cloud copy of %s no longer exists.",
+                    fd_path(r.fd).c_str());
+            hsm_clear_recall(r.fd);
+            hsm_mark_lost(r.fd);
+            finish(r, false);
+        }
+        else {
+            syslog(LOG_WARNING, "Unable to restore %s, will retry: %s",
+                    fd_path(r.fd).c_str(), strerror(error));
+
+            /* A process blocked on the file cannot wait for the retry. */
+            if (r.fan_fd >= 0) {
+                respond(r.fan_fd, r.fd, false);
+                r.fan_fd = -1;
+            }
+            retry.push_back(r);
+        }
+    }
+    this->queued.swap(retry);
+    return issued;
+}
+
+int restore_queue::poll() {
+    int recalled = 0;
+    vector<recall> waiting;
+    for (const recall& r : this->requested) {
+
+        /* Only a missing object means the file is lost; any other failure
+         * may be transient, so the recall is tried again on the next poll. */
+        int ready = this->target.restore_ready(r.fd);
+        if (ready > 0 && this->target.download_file(r.fd) >= 0) {
+            hsm_clear_restore(r.fd);
+            hsm_clear_stub(r.fd);
+            hsm_clear_recall(r.fd);
+            hsm_record_recall(r.fd);
+            finish(r, true);
+            recalled++;
+        }
+        else if (ready != 0 && errno == ENOENT) {
+            syslog(LOG_ERR, "The cloud copy of %s no longer exists.",
+                    fd_path(r.fd).c_str());
+            hsm_clear_restore(r.fd);
+            hsm_clear_recall(r.fd);
+            hsm_mark_lost(r.fd);
+            finish(r, false);
+        }
+        else if (ready != 0 && errno == ESTALE) {
+
+            /* The restored copy expired before it was downloaded. */
+            syslog(LOG_WARNING, "The restored copy of %s expired and will be "
+                    "restored again.", fd_path(r.fd).c_str());
+            hsm_clear_restore(r.fd);
+            this->queued.push_back(r);
+        }
+        else {
+            if (ready != 0) {
+                int error = errno;
+                syslog(LOG_WARNING, "Unable to recall %s, will retry: %s",
+                        fd_path(r.fd).c_str(), strerror(error));
+            }
+            waiting.push_back(r);
+        }
+    }
+    this->requested.swap(waiting);
+    return recalled;
+}
+
+size_t restore_queue::size() {
+    return this->queued.size() + this->requested.size();
+}
+
+void restore_queue::finish(const recall& r, bool allow) {
+    if (r.fan_fd >= 0)
+        respond(r.fan_fd, r.fd, allow);
+    close(r.fd);
+}
+
+restore_queue::~restore_queue() {
+    for (const recall& r : this->queued)
+        finish(r, false);
+    for (const recall& r : this->requested)
+        finish(r, false);
+}
@@ -14,12 +14,125 @@
  * limitations under the License.
  */
 
-#include "s3.h"
+#include "common/s3.h"
+#include "common/xattr.h"
+
+#include <algorithm>
+#include <limits.h>
+#include <unistd.h>
 
 s3::s3() {
 }
 
+s3::s3(string bucket, string prefix, string access_key, string secret_key) {
+    
+    this->bucket = bucket;
+    this->prefix = prefix;
+    this->access_key = access_key;
+    this->secret_key = secret_key;
+    
+}
+
+s3::s3(string bucket, string prefix) {
+    
+    this->bucket = bucket;
+    this->prefix = prefix;
+    
+}
+
 s3::s3(const s3& orig) {
+    
+    this->bucket = orig.bucket;
+    this->prefix = orig.prefix;
+    this->access_key = orig.access_key;
+    this->secret_key = orig.secret_key;
+    this->tier = orig.tier;
+    this->endpoint = orig.endpoint;
+    
+}
+
+string s3::get_endpoint() {
+    return this->endpoint;
+}
+
+void s3::set_endpoint(string endpoint) {
+    this->endpoint = endpoint;
+}
+
+string s3::get_object_key(int fd) {
+
+    /* S3 keys are relative to the bucket, so drop any leading slash. */
+    string key = this->prefix.substr(min(this->prefix.size(),
+            this->prefix.find_first_not_of('/')));
+
+    char id[HSM_ID_LENGTH + 1];
+    if (hsm_get_id(fd, id, sizeof(id)) < 0) {
+
+        /* A file stored before object IDs is still stored under its path,
+         * until migrate_files() has moved it. */
+        if (hsm_is_legacy(fd)) {
+            char path[PATH_MAX];
+            ssize_t len = readlink(("/proc/self/fd/" + to_string(fd)).c_str(),
+                    path, sizeof(path) - 1);
+            if (len <= 0)
+                return "";
+            path[len] = '\0';
+            if (!key.empty() && key.back() != '/')
+                key += "/";
+            return key + (path + 1);
+        }
+        if (hsm_set_id(fd) < 0 || hsm_get_id(fd, id, sizeof(id)) < 0)
+            return "";
+    }
+
+    if (!key.empty() && key.back() != '/')
+        key += "/";
+    return key + id;
+}
+
+int s3::migrate_files(vector<int>& fds) {
+    vector<pair<string, string>> keys;
+    vector<int> moving;
+    vector<string> ids;
+    for (int fd : fds) {
+        if (!hsm_is_legacy(fd))
+            continue;
+        char id[HSM_ID_LENGTH + 1];
+        string old_key = this->get_object_key(fd);
+        if (old_key.empty() || hsm_new_id(id, sizeof(id)) < 0)
+            return -1;
+
+        /* The new key is the old one with the path replaced by the ID. */
+        string key = this->prefix.substr(min(this->prefix.size(),
+                this->prefix.find_first_not_of('/')));
+        if (!key.empty() && key.back() != '/')
+            key += "/";
+        keys.emplace_back(old_key, key + id);
+        moving.push_back(fd);
+        ids.push_back(id);
+    }
+    if (keys.empty())
+        return 0;
+
+    /* The ID is only recorded once the object is in place under it, so a
+     * file is never left pointing at a key with nothing behind it. */
+    vector<int> results;
+    this->rename_objects(keys, results);
+    int migrated = 0;
+    for (size_t i = 0; i < moving.size(); i++) {
+        if (i < results.size() && results[i] == 0
+                && hsm_set_migrated_id(moving[i], ids[i].c_str()) >= 0)
+            migrated++;
+    }
+    return migrated;
+}
+
+string s3::get_tier() {
+    return this->tier;
+}
+
+void s3::set_tier(string tier) {
+    this->tier = tier;
 }
 
 s3::~s3() {
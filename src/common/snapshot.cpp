@@ -0,0 +1,268 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/snapshot.h"
+#include "common/xattr.h"
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <mutex>
+#include <set>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * The prefix of the name of every snapshot taken by a batch.
+ */
+#define SNAPSHOT_PREFIX "cloudsm-"
+
+/**
+ * The number of snapshots taken by this process, used to keep the names of
+ * snapshots taken within the same second apart.
+ */
+static atomic<unsigned long> snapshots_taken(0);
+
+/**
+ * The lock guarding the set of datasets swept.
+ */
+static mutex swept_lock;
+
+/**
+ * The datasets whose stale snapshots have been swept by this process.
+ */
+static set<string> swept;
+
+snapshot::snapshot(string mountpoint) {
+
+    this->mountpoint = mountpoint;
+    this->reflinks = true;
+
+}
+
+snapshot::snapshot(string mountpoint, string dataset) {
+
+    this->mountpoint = mountpoint;
+    this->dataset = dataset;
+    this->reflinks = true;
+
+}
+
+void snapshot::add(int fd) {
+    entry e = { fd, hsm_get_generation(fd) };
+    this->entries.push_back(e);
+}
+
+int snapshot::take() {
+    if (this->dataset.empty() || !this->name.empty())
+        return 0;
+
+    /* Clear out any snapshots left behind by a crash the first time one of
+     * each dataset is taken by this process. */
+    bool first;
+    {
+        lock_guard<mutex> guard(swept_lock);
+        first = swept.insert(this->dataset).second;
+    }
+    if (first)
+        sweep(this->dataset);
+
+    string name = SNAPSHOT_PREFIX + to_string(getpid()) + "-"
+            + to_string(time(NULL)) + "-" + to_string(snapshots_taken++);
+    if (zfs({ "snapshot", this->dataset + "@" + name }, NULL) != 0)
+        return -1;
+    this->name = name;
+    return 0;
+}
+
+int snapshot::sweep(string dataset) {
+    string output;
+    if (zfs({ "list", "-H", "-o", "name", "-t", "snapshot", "-d", "1",
+            dataset }, &output) != 0)
+        return -1;
+
+    int destroyed = 0;
+    string prefix = dataset + "@" SNAPSHOT_PREFIX;
+    size_t start = 0;
+    while (start < output.size()) {
+        size_t end = output.find('\n', start);
+        if (end == string::npos)
+            end = output.size();
+        string snap = output.substr(start, end - start);
+        start = end + 1;
+        if (snap.compare(0, prefix.size(), prefix) != 0)
+            continue;
+
+        /* Leave the snapshots of batches still running in other processes. */
+        pid_t pid = (pid_t) atol(snap.c_str() + prefix.size());
+        if (pid <= 0 || (kill(pid, 0) != 0 && errno == ESRCH)) {
+            if (zfs({ "destroy", snap }, NULL) == 0) {
+                syslog(LOG_INFO, "Destroyed stale snapshot %s.", snap.c_str());
+                destroyed++;
+            }
+        }
+    }
+    return destroyed;
+}
+
+int snapshot::upload(s3& target) {
+    return upload_with([&](int fd, int source, uint64_t) {
+        return target.upload_file(fd, source);
+    });
+}
+
+int snapshot::upload(replicas& targets) {
+    return upload_with([&](int fd, int source, uint64_t gen) {
+        return targets.upload_file(fd, source, gen);
+    });
+}
+
+int snapshot::upload_with(
+        function<ssize_t(int, int, uint64_t)> upload_file) {
+    int uploaded = 0;
+    for (const entry& e : this->entries) {
+        int source = open_copy(e.fd);
+        if (source >= 0) {
+            if (upload_file(e.fd, source, e.gen) >= 0) {
+                hsm_clear_dirty_gen(e.fd, e.gen);
+                uploaded++;
+            }
+            close(source);
+        }
+        close(e.fd);
+    }
+    this->entries.clear();
+    return uploaded;
+}
+
+int snapshot::open_copy(int fd) {
+    char path[PATH_MAX];
+    string link = "/proc/self/fd/" + to_string(fd);
+    ssize_t len = readlink(link.c_str(), path, sizeof(path) - 1);
+    if (len <= 0)
+        return -1;
+    path[len] = '\0';
+    string live = path;
+    if (live.compare(0, this->mountpoint.size(), this->mountpoint) != 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return -1;
+
+    /* Read from the snapshot if one was taken for the batch. The file is
+     * found by its current path, so the copy is only used if it is the same
+     * file; ZFS keeps object numbers in snapshots, so a file renamed over
+     * since the snapshot was taken shows up as a different inode. */
+    if (!this->name.empty()) {
+        string snap = this->mountpoint + "/.zfs/snapshot/" + this->name
+                + live.substr(this->mountpoint.size());
+        int copy = open(snap.c_str(), O_RDONLY | O_NOATIME);
+        struct stat copy_st;
+        if (copy >= 0 && fstat(copy, &copy_st) == 0
+                && copy_st.st_ino == st.st_ino)
+            return copy;
+        if (copy >= 0)
+            close(copy);
+    }
+
+    /* Otherwise clone the file into an anonymous file beside it. */
+    if (this->reflinks) {
+        string dir = live.substr(0, live.rfind('/'));
+        int copy = open(dir.c_str(), O_TMPFILE | O_RDWR, 0600);
+        if (copy >= 0 && ioctl(copy, FICLONE, fd) == 0)
+            return copy;
+
+        int error = errno;
+        if (copy >= 0)
+            close(copy);
+        syslog(LOG_WARNING, "Unable to clone %s (%s); files in this batch "
+                "will be uploaded from the live files.", live.c_str(),
+                strerror(error));
+        this->reflinks = false;
+    }
+
+    /* As a last resort, read the live file. Any write made while it is read
+     * changes its write generation, which leaves the file dirty so that it
+     * is uploaded again. */
+    int copy = open(link.c_str(), O_RDONLY | O_NOATIME);
+    if (copy < 0 && errno == EPERM)
+        copy = open(link.c_str(), O_RDONLY);
+    return copy;
+}
+
+int snapshot::zfs(vector<string> args, string* output) {
+    vector<char*> argv;
+    argv.push_back((char*) "zfs");
+    for (string& arg : args)
+        argv.push_back((char*) arg.c_str());
+    argv.push_back(NULL);
+
+    int out[2] = { -1, -1 };
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (output != NULL) {
+        if (pipe2(out, O_CLOEXEC) != 0) {
+            posix_spawn_file_actions_destroy(&actions);
+            return -1;
+        }
+        posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    }
+
+    pid_t pid;
+    int status;
+    int spawned = posix_spawnp(&pid, "zfs", &actions, NULL, argv.data(),
+            environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (output != NULL) {
+        close(out[1]);
+        char buf[4096];
+        ssize_t got;
+        while (spawned == 0 && (got = read(out[0], buf, sizeof(buf))) != 0) {
+            if (got > 0)
+                output->append(buf, got);
+            else if (errno != EINTR)
+                break;
+        }
+        close(out[0]);
+    }
+    if (spawned != 0)
+        return -1;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+        return -1;
+    return 0;
+}
+
+snapshot::~snapshot() {
+
+    for (const entry& e : this->entries)
+        close(e.fd);
+
+    if (!this->name.empty())
+        zfs({ "destroy", this->dataset + "@" + this->name }, NULL);
+
+}
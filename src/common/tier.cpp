@@ -0,0 +1,204 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/tier.h"
+#include "common/xattr.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+/**
+ * The storage classes that files may be placed in, ordered from the most
+ * to the least expensive to store. INTELLIGENT_TIERING is not included, as
+ * it moves objects between its own tiers and is only used when configured
+ * as the default for a directory.
+ */
+static const storage_class classes[] = {
+    { "STANDARD",     0.023,   0.0,  0,         false, 0   },
+    { "STANDARD_IA",  0.0125,  0.01, 0,         false, 30  },
+    { "GLACIER_IR",   0.004,   0.03, 0,         false, 90  },
+    { "GLACIER",      0.0036,  0.01, 5 * 3600,  true,  90  },
+    { "DEEP_ARCHIVE", 0.00099, 0.02, 12 * 3600, true,  180 }
+};
+
+/**
+ * The number of seconds in an average month.
+ */
+#define SECONDS_PER_MONTH (30 * 24 * 3600)
+
+/**
+ * The number of seconds in a day.
+ */
+#define SECONDS_PER_DAY (24 * 3600)
+
+/**
+ * Returns the monthly cost of keeping a file in a storage class, per GB.
+ *
+ * @param sc
+ *     The storage class.
+ *
+ * @param rate
+ *     The estimated number of recalls of the file per month.
+ *
+ * @return
+ *     The storage cost plus the expected retrieval cost.
+ */
+static double tier_cost(const storage_class* sc, double rate) {
+    return sc->storage_cost + sc->retrieval_cost * rate;
+}
+
+const storage_class* tier_find(const char* name) {
+    for (const storage_class& sc : classes) {
+        if (strcmp(sc.name, name) == 0)
+            return &sc;
+    }
+    return NULL;
+}
+
+double tier_recall_rate(int fd, time_t now) {
+    uint64_t accesses = hsm_get_accesses(fd);
+    time_t first_seen = hsm_get_first_seen(fd);
+    if (accesses == 0 || first_seen == 0 || first_seen > now)
+        return 0.0;
+    double age = (double) (now - first_seen) / SECONDS_PER_MONTH;
+    double idle = (double) (now - hsm_get_last_access(fd)) / SECONDS_PER_MONTH;
+    return accesses / (age < 1.0 ? 1.0 : age) / (1.0 + (idle < 0 ? 0 : idle));
+}
+
+const storage_class* tier_select(int fd, time_t latency, time_t now) {
+    double rate = tier_recall_rate(fd, now);
+    const storage_class* best = &classes[0];
+    double best_cost = best->storage_cost;
+    for (const storage_class& sc : classes) {
+        if (sc.first_byte > latency)
+            continue;
+        double cost = tier_cost(&sc, rate);
+        if (cost < best_cost) {
+            best = &sc;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+tier_batch::tier_batch(s3& target, time_t latency, int days)
+        : target(target), latency(latency), days(days) {
+}
+
+int tier_batch::add(int fd) {
+
+    /* Files uploaded before their storage class was recorded are in the
+     * class configured for the directory, or the bucket default. */
+    char current[32];
+    if (hsm_get_tier(fd, current, sizeof(current)) < 0) {
+        string tier = this->target.get_tier();
+        snprintf(current, sizeof(current), "%s",
+                tier.empty() ? "STANDARD" : tier.c_str());
+    }
+
+    /* Classes that are not in the table, such as INTELLIGENT_TIERING, manage
+     * their own placement and are left alone. */
+    time_t now = time(NULL);
+    const storage_class* from = tier_find(current);
+    const storage_class* sc = tier_select(fd, this->latency, now);
+    if (from == NULL || from == sc) {
+        close(fd);
+        return 0;
+    }
+
+    /* Moving out before the minimum duration is charged for anyway, and a
+     * small saving is not worth the risk of moving straight back. A class
+     * that no longer meets the latency target is always left. */
+    double rate = tier_recall_rate(fd, now);
+    time_t since = hsm_get_tier_time(fd);
+    if (from->first_byte <= this->latency
+            && ((since > 0 && now - since
+                    < (time_t) from->min_days * SECONDS_PER_DAY)
+            || tier_cost(sc, rate)
+                    > tier_cost(from, rate) * (1.0 - TIER_HYSTERESIS))) {
+        close(fd);
+        return 0;
+    }
+
+    /* An archived object cannot be copied until it has been restored, so
+     * the restore is requested first and the move is made on a later pass
+     * once the restored copy is available. A restored copy that expired
+     * before that pass is restored again. */
+    if (from->archive) {
+        if (!hsm_is_restoring(fd)) {
+            this->restores.push_back(fd);
+            return 1;
+        }
+        int ready = this->target.restore_ready(fd);
+        if (ready < 0 && errno == ESTALE) {
+            hsm_clear_restore(fd);
+            this->restores.push_back(fd);
+            return 1;
+        }
+        if (ready != 1) {
+            close(fd);
+            return 0;
+        }
+    }
+    this->pending[sc->name].push_back(fd);
+    return 1;
+}
+
+int tier_batch::flush() {
+    int moved = 0;
+    bool failed = false;
+    if (!this->restores.empty()) {
+        vector<int> results;
+        this->target.restore_files(this->restores, this->days, results);
+        for (size_t i = 0; i < this->restores.size(); i++) {
+            int fd = this->restores[i];
+            int error = i < results.size() ? results[i] : EIO;
+            if (error == 0)
+                hsm_mark_restore(fd);
+            else {
+                syslog(LOG_WARNING, "Unable to restore %s for a storage "
+                        "class move, will retry: %s",
+                        this->target.get_object_key(fd).c_str(),
+                        strerror(error));
+            }
+            close(fd);
+        }
+        this->restores.clear();
+    }
+    for (auto& entry : this->pending) {
+        int count = this->target.change_tier(entry.second, entry.first);
+        if (count < 0)
+            failed = true;
+        for (int fd : entry.second) {
+            if (count >= 0) {
+                hsm_set_tier(fd, entry.first.c_str());
+                hsm_clear_restore(fd);
+            }
+            close(fd);
+        }
+        if (count > 0)
+            moved += count;
+    }
+    this->pending.clear();
+    return failed ? -1 : moved;
+}
+
+tier_batch::~tier_batch() {
+    this->flush();
+}
@@ -16,8 +16,13 @@
 
 #include "common/xattr.h"
 
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <unistd.h>
@@ -56,41 +61,185 @@ static uint8_t get_flags(int fd) {
 static char* get_stats(int fd) {
     ssize_t xa_size = fgetxattr(fd, HSM_XATTR_STAT_NAME, NULL, 0);
     if (xa_size > 0) {
-        char* stats = malloc(xa_size);
+        char* stats = (char*) malloc(xa_size);
         fgetxattr(fd, HSM_XATTR_STAT_NAME, stats, xa_size);
         return stats;
     }
     return NULL;
 }
 
+/**
+ * Retrieve the access history for a file from the extended attribute that
+ * stores it. Any field that is not present is returned as zero.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose access history is being
+ *     queried.
+ * 
+ * @param temp
+ *     An array that receives the access count, recall count, first seen
+ *     time, and last access time, in that order.
+ */
+static void get_temp(int fd, uint64_t temp[4]) {
+    char buf[96];
+    temp[0] = temp[1] = temp[2] = temp[3] = 0;
+    ssize_t len = fgetxattr(fd, HSM_XATTR_TEMP_NAME, buf, sizeof(buf) - 1);
+    if (len <= 0)
+        return;
+    buf[len] = '\0';
+    sscanf(buf, "/%" SCNu64 "/%" SCNu64 "/%" SCNu64 "/%" SCNu64,
+            &temp[0], &temp[1], &temp[2], &temp[3]);
+}
+
+/**
+ * Store the access history for a file in the extended attribute that
+ * stores it.
+ * 
+ * @param fd
+ *     The file descriptor pointing to the file whose access history is being
+ *     stored.
+ * 
+ * @param temp
+ *     The access count, recall count, first seen time, and last access time,
+ *     in that order.
+ * 
+ * @return 
+ *     The number of bytes written to the xattr, or -1 if an error occurs.
+ */
+static ssize_t set_temp(int fd, const uint64_t temp[4]) {
+    char buf[96];
+    int len = snprintf(buf, sizeof(buf),
+            "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64,
+            temp[0], temp[1], temp[2], temp[3]);
+    if (fsetxattr(fd, HSM_XATTR_TEMP_NAME, buf, len, 0) != 0)
+        return -1;
+    return len;
+}
+
 ssize_t hsm_clear_dirty(int fd) {
 	uint8_t flags = get_flags(fd);
-	flags ~= HSM_XATTR_FLAG_DIRTY;
+	flags &= ~HSM_XATTR_FLAG_DIRTY;
 	return fsetxattr(fd, HSM_XATTR_FLAG_NAME, &flags, sizeof(flags), 0);
 }
 
+int hsm_clear_dirty_gen(int fd, uint64_t gen) {
+    if (hsm_get_generation(fd) != gen)
+        return 0;
+    if (hsm_clear_dirty(fd) != 0)
+        return -1;
+
+    /* A write may have landed between the check and the clear. */
+    if (hsm_get_generation(fd) != gen) {
+        hsm_mark_dirty(fd);
+        return 0;
+    }
+    return 1;
+}
+
 ssize_t hsm_clear_lost(int fd) {
     uint8_t flags = get_flags(fd);
-    flags ~= HSM_XATTR_FLAG_LOST;
+    flags &= ~HSM_XATTR_FLAG_LOST;
     return fsetxattr(fd, HSM_XATTR_FLAG_NAME, &flags, sizeof(flags), 0);
 }
 
 ssize_t hsm_clear_recall(int fd) {
     uint8_t flags = get_flags(fd);
-    flags ~= HSM_XATTR_FLAG_RECALL;
+    flags &= ~HSM_XATTR_FLAG_RECALL;
     return fsetxattr(fd, HSM_XATTR_FLAG_NAME, &flags, sizeof(flags), 0);
 }
 
 ssize_t hsm_clear_stub(int fd) {
     uint8_t flags = get_flags(fd);
-    flags ~= HSM_XATTR_FLAG_STUB;
+    flags &= ~HSM_XATTR_FLAG_STUB;
+    return fsetxattr(fd, HSM_XATTR_FLAG_NAME, &flags, sizeof(flags), 0);
+}
+
+ssize_t hsm_clear_restore(int fd) {
+    uint8_t flags = get_flags(fd);
+    flags &= ~HSM_XATTR_FLAG_RESTORE;
     return fsetxattr(fd, HSM_XATTR_FLAG_NAME, &flags, sizeof(flags), 0);
 }
 
+uint64_t hsm_get_accesses(int fd) {
+    uint64_t temp[4];
+    get_temp(fd, temp);
+    return temp[0];
+}
+
+time_t hsm_get_first_seen(int fd) {
+    uint64_t temp[4];
+    get_temp(fd, temp);
+    return (time_t) temp[2];
+}
+
+uint64_t hsm_get_generation(int fd) {
+    uint64_t gen = 0;
+    fgetxattr(fd, HSM_XATTR_GEN_NAME, &gen, sizeof(gen));
+    return gen;
+}
+
+ssize_t hsm_get_id(int fd, char* id, size_t size) {
+    if (size < HSM_ID_LENGTH + 1)
+        return -1;
+    ssize_t len = fgetxattr(fd, HSM_XATTR_ID_NAME, id, HSM_ID_LENGTH);
+    if (len != HSM_ID_LENGTH)
+        return -1;
+    id[len] = '\0';
+    return len;
+}
+
+time_t hsm_get_last_access(int fd) {
+    uint64_t temp[4];
+    get_temp(fd, temp);
+    return (time_t) temp[3];
+}
+
+uint32_t hsm_get_replicas(int fd, uint64_t gen) {
+    uint64_t value[2];
+    if (fgetxattr(fd, HSM_XATTR_REPLICAS_NAME, value, sizeof(value))
+            != sizeof(value) || value[0] != gen)
+        return 0;
+    return (uint32_t) value[1];
+}
+
+uint64_t hsm_get_recalls(int fd) {
+    uint64_t temp[4];
+    get_temp(fd, temp);
+    return temp[1];
+}
+
+ssize_t hsm_get_tier(int fd, char* tier, size_t size) {
+    if (size == 0)
+        return -1;
+    ssize_t len = fgetxattr(fd, HSM_XATTR_TIER_NAME, tier, size - 1);
+    if (len < 0)
+        return -1;
+    tier[len] = '\0';
+    return len;
+}
+
+time_t hsm_get_tier_time(int fd) {
+    uint64_t when;
+    if (fgetxattr(fd, HSM_XATTR_TIER_TIME_NAME, &when, sizeof(when))
+            != sizeof(when))
+        return 0;
+    return (time_t) when;
+}
+
 int hsm_is_dirty(int fd) {
 	return (get_flags(fd) & HSM_XATTR_FLAG_DIRTY);
 }
 
+int hsm_is_legacy(int fd) {
+    char id[HSM_ID_LENGTH + 1];
+    uint8_t flags;
+    if (hsm_get_id(fd, id, sizeof(id)) >= 0
+            || fgetxattr(fd, HSM_XATTR_FLAG_NAME, &flags, sizeof(flags))
+            != sizeof(flags))
+        return 0;
+    return (flags & HSM_XATTR_FLAG_STUB) || !(flags & HSM_XATTR_FLAG_DIRTY);
+}
+
 int hsm_is_lost(int fd) {
 	return (get_flags(fd) & HSM_XATTR_FLAG_LOST);
 }
@@ -99,11 +248,18 @@ int hsm_is_recalled(int fd) {
 	return (get_flags(fd) & HSM_XATTR_FLAG_RECALL);
 }
 
+int hsm_is_restoring(int fd) {
+	return (get_flags(fd) & HSM_XATTR_FLAG_RESTORE);
+}
+
 int hsm_is_stub(int fd) {
 	return (get_flags(fd) & HSM_XATTR_FLAG_STUB);
 }
 
 ssize_t hsm_mark_dirty(int fd) {
+    uint64_t gen = hsm_get_generation(fd) + 1;
+    fsetxattr(fd, HSM_XATTR_GEN_NAME, &gen, sizeof(gen), 0);
+    fremovexattr(fd, HSM_XATTR_REPLICAS_NAME);
     uint8_t flags = get_flags(fd);
     flags |= HSM_XATTR_FLAG_DIRTY;
     return fsetxattr(fd, HSM_XATTR_FLAG_NAME, &flags, sizeof(flags), 0);
@@ -121,8 +277,112 @@ ssize_t hsm_mark_recall(int fd) {
     return fsetxattr(fd, HSM_XATTR_FLAG_NAME, &flags, sizeof(flags), 0);
 }
 
+ssize_t hsm_mark_restore(int fd) {
+    uint8_t flags = get_flags(fd);
+    flags |= HSM_XATTR_FLAG_RESTORE;
+    return fsetxattr(fd, HSM_XATTR_FLAG_NAME, &flags, sizeof(flags), 0);
+}
+
 ssize_t hsm_mark_stub(int fd) {
     uint8_t flags = get_flags(fd);
     flags |= HSM_XATTR_FLAG_STUB;
     return fsetxattr(fd, HSM_XATTR_FLAG_NAME, &flags, sizeof(flags), 0);
-}
\ No newline at end of file
+}
+
+ssize_t hsm_record_access(int fd) {
+    uint64_t temp[4];
+    uint64_t now = (uint64_t) time(NULL);
+    get_temp(fd, temp);
+    temp[0]++;
+    if (temp[2] == 0)
+        temp[2] = now;
+    temp[3] = now;
+    return set_temp(fd, temp);
+}
+
+ssize_t hsm_record_recall(int fd) {
+    uint64_t temp[4];
+    uint64_t now = (uint64_t) time(NULL);
+    get_temp(fd, temp);
+    temp[0]++;
+    temp[1]++;
+    if (temp[2] == 0)
+        temp[2] = now;
+    temp[3] = now;
+    return set_temp(fd, temp);
+}
+
+ssize_t hsm_new_id(char* id, size_t size) {
+    uint8_t uuid[16];
+    if (size < HSM_ID_LENGTH + 1
+            || getrandom(uuid, sizeof(uuid), 0) != sizeof(uuid))
+        return -1;
+
+    /* Random (version 4, RFC 4122 variant) UUID. */
+    uuid[6] = (uuid[6] & 0x0f) | 0x40;
+    uuid[8] = (uuid[8] & 0x3f) | 0x80;
+
+    snprintf(id, size, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-"
+            "%02x%02x%02x%02x%02x%02x", uuid[0], uuid[1], uuid[2], uuid[3],
+            uuid[4], uuid[5], uuid[6], uuid[7], uuid[8], uuid[9], uuid[10],
+            uuid[11], uuid[12], uuid[13], uuid[14], uuid[15]);
+    return HSM_ID_LENGTH;
+}
+
+ssize_t hsm_set_id(int fd) {
+
+    /* The only copy of a stub's data is the object under its current ID. */
+    if (hsm_is_stub(fd)) {
+        errno = EPERM;
+        return -1;
+    }
+
+    char old[HSM_ID_LENGTH + 1];
+    bool rekeyed = hsm_get_id(fd, old, sizeof(old)) >= 0;
+
+    char id[HSM_ID_LENGTH + 1];
+    if (hsm_new_id(id, sizeof(id)) < 0
+            || fsetxattr(fd, HSM_XATTR_ID_NAME, id, HSM_ID_LENGTH, 0) != 0)
+        return -1;
+
+    /* Nothing has been uploaded under the new ID yet. Replacing an ID also
+     * moves the write generation on, so that an upload still running under
+     * the old ID cannot mark the file clean or its replicas current when it
+     * finishes. */
+    if (rekeyed)
+        return hsm_mark_dirty(fd) != 0 ? -1 : HSM_ID_LENGTH;
+    fremovexattr(fd, HSM_XATTR_REPLICAS_NAME);
+    uint8_t flags = get_flags(fd) | HSM_XATTR_FLAG_DIRTY;
+    if (fsetxattr(fd, HSM_XATTR_FLAG_NAME, &flags, sizeof(flags), 0) != 0)
+        return -1;
+    return HSM_ID_LENGTH;
+}
+
+ssize_t hsm_set_migrated_id(int fd, const char* id) {
+    if (strlen(id) != HSM_ID_LENGTH) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fsetxattr(fd, HSM_XATTR_ID_NAME, id, HSM_ID_LENGTH, XATTR_CREATE)
+            != 0)
+        return -1;
+    return HSM_ID_LENGTH;
+}
+
+int hsm_set_replicas(int fd, uint64_t gen, uint32_t replicas) {
+    if (hsm_get_generation(fd) != gen)
+        return 0;
+    uint64_t value[2] = { gen, replicas };
+    if (fsetxattr(fd, HSM_XATTR_REPLICAS_NAME, value, sizeof(value), 0) != 0)
+        return -1;
+
+    /* The mask is ignored once the generation moves on, so a write landing
+     * between the check and the update does no harm. */
+    return 1;
+}
+
+ssize_t hsm_set_tier(int fd, const char* tier) {
+    uint64_t now = (uint64_t) time(NULL);
+    fsetxattr(fd, HSM_XATTR_TIER_TIME_NAME, &now, sizeof(now), 0);
+    return fsetxattr(fd, HSM_XATTR_TIER_NAME, tier, strlen(tier), 0);
+}
@@ -0,0 +1,413 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mock_s3.h"
+
+#include "common/checksum.h"
+#include "common/delta.h"
+#include "common/xattr.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * The number of checks that have failed.
+ */
+static int failures = 0;
+
+/**
+ * Check that a condition holds, reporting it as a failure if it does not.
+ */
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, \
+                    __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/**
+ * The number of random edits made to a file by the patch tests.
+ */
+#define TEST_EDITS 40
+
+/**
+ * The header of a patch, as written by delta::sync().
+ */
+struct patch_header {
+    char magic[8];
+    uint64_t block_size;
+    uint64_t size;
+    uint64_t count;
+};
+
+/**
+ * A single instruction in a patch, as written by delta::sync().
+ */
+struct patch_op {
+    uint64_t offset;
+    uint64_t length;
+    int64_t source;
+};
+
+/**
+ * The scratch directory the tests run in.
+ */
+static string scratch;
+
+/**
+ * Returns random data.
+ *
+ * @param size
+ *     The number of bytes of data.
+ *
+ * @return
+ *     The data.
+ */
+static vector<uint8_t> random_data(size_t size) {
+    vector<uint8_t> data(size);
+    for (uint8_t& c : data)
+        c = (uint8_t) rand();
+    return data;
+}
+
+/**
+ * Read the whole of a file.
+ *
+ * @param path
+ *     The path of the file.
+ *
+ * @param data
+ *     The vector that receives the contents of the file.
+ *
+ * @return
+ *     True if the file was read, false if it does not exist.
+ */
+static bool read_file(const string& path, vector<uint8_t>& data) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == NULL)
+        return false;
+    data.clear();
+    uint8_t buf[65536];
+    size_t got;
+    while ((got = fread(buf, 1, sizeof(buf), file)) > 0)
+        data.insert(data.end(), buf, buf + got);
+    fclose(file);
+    return true;
+}
+
+/**
+ * Replace the contents of a file.
+ *
+ * @param fd
+ *     The file descriptor of the file.
+ *
+ * @param data
+ *     The new contents of the file.
+ */
+static void rewrite(int fd, const vector<uint8_t>& data) {
+    CHECK(ftruncate(fd, 0) == 0);
+    CHECK(pwrite(fd, data.data(), data.size(), 0) == (ssize_t) data.size());
+    hsm_mark_dirty(fd);
+}
+
+/**
+ * Apply a patch to the previous version of a file.
+ *
+ * @param old
+ *     The previous version of the file.
+ *
+ * @param patch
+ *     The patch.
+ *
+ * @param result
+ *     The vector that receives the new version of the file.
+ *
+ * @return
+ *     True if the patch is well formed, false otherwise.
+ */
+static bool apply(const vector<uint8_t>& old, const vector<uint8_t>& patch,
+        vector<uint8_t>& result) {
+    patch_header header;
+    if (patch.size() < sizeof(header))
+        return false;
+    memcpy(&header, patch.data(), sizeof(header));
+    if (memcmp(header.magic, "CSMPAT01", sizeof(header.magic)) != 0
+            || header.block_size != DELTA_BLOCK_SIZE)
+        return false;
+
+    size_t literal = sizeof(header) + header.count * sizeof(patch_op);
+    if (patch.size() < literal)
+        return false;
+    result.assign(header.size, 0);
+    uint64_t covered = 0;
+    for (uint64_t i = 0; i < header.count; i++) {
+        patch_op op;
+        memcpy(&op, patch.data() + sizeof(header) + i * sizeof(op),
+                sizeof(op));
+        if (op.offset != covered || op.offset + op.length > header.size)
+            return false;
+        if (op.source >= 0) {
+            if ((uint64_t) op.source + op.length > old.size())
+                return false;
+            memcpy(result.data() + op.offset, old.data() + op.source,
+                    op.length);
+        }
+        else {
+            if (literal + op.length > patch.size())
+                return false;
+            memcpy(result.data() + op.offset, patch.data() + literal,
+                    op.length);
+            literal += op.length;
+        }
+        covered += op.length;
+    }
+    return covered == header.size && literal == patch.size();
+}
+
+/**
+ * Rebuild the current version of a file from its object and the patches
+ * uploaded on top of it.
+ *
+ * @param object
+ *     The path of the object in the mock endpoint.
+ *
+ * @param data
+ *     The vector that receives the rebuilt file.
+ *
+ * @return
+ *     The number of patches applied, or -1 if the object or a patch could not
+ *     be read or applied.
+ */
+static int rebuild(const string& object, vector<uint8_t>& data) {
+    if (!read_file(object, data))
+        return -1;
+    int seq = 1;
+    vector<uint8_t> patch;
+    for (; read_file(object + ".patch." + to_string(seq), patch); seq++) {
+        vector<uint8_t> next;
+        if (!apply(data, patch, next))
+            return -1;
+        data.swap(next);
+    }
+    return seq - 1;
+}
+
+/**
+ * The vectorized weak checksum matches the byte-at-a-time definition, and
+ * rolling it forward matches computing it afresh.
+ */
+static void test_checksums() {
+    for (size_t size : { 0, 1, 15, 16, 17, 31, 255, 4096, 4111,
+            DELTA_BLOCK_SIZE }) {
+        vector<uint8_t> data = random_data(size);
+        uint32_t a = 0;
+        uint32_t b = 0;
+        for (size_t i = 0; i < size; i++) {
+            a += data[i];
+            b += (uint32_t) (size - i) * data[i];
+        }
+        CHECK(delta_weak(data.data(), size) == ((a & 0xffff) | (b << 16)));
+    }
+
+    /* All bytes 0xff gives the largest sums the block size allows. */
+    vector<uint8_t> ones(DELTA_BLOCK_SIZE, 0xff);
+    uint32_t b = 0;
+    for (size_t i = 0; i < ones.size(); i++)
+        b += (uint32_t) (ones.size() - i) * 0xff;
+    CHECK(delta_weak(ones.data(), ones.size())
+            == (((uint32_t) ones.size() * 0xff & 0xffff) | (b << 16)));
+
+    vector<uint8_t> data = random_data(DELTA_BLOCK_SIZE + 1000);
+    uint32_t weak = delta_weak(data.data(), DELTA_BLOCK_SIZE);
+    bool rolled = true;
+    for (size_t pos = 0; pos < 1000; pos++) {
+        weak = delta_roll(weak, DELTA_BLOCK_SIZE, data[pos],
+                data[pos + DELTA_BLOCK_SIZE]);
+        rolled = rolled && weak == delta_weak(data.data() + pos + 1,
+                DELTA_BLOCK_SIZE);
+    }
+    CHECK(rolled);
+}
+
+/**
+ * Random inserts, deletions, flipped bytes, appends and truncations are
+ * uploaded as patches that rebuild the file exactly from the last full copy.
+ */
+static void test_patches() {
+    string endpoint = scratch + "/patches";
+    string catalog = scratch + "/patches-catalog";
+    mkdir(endpoint.c_str(), 0700);
+    mkdir(catalog.c_str(), 0700);
+    s3 target("test", "");
+    target.set_endpoint(endpoint);
+    delta sync(catalog);
+
+    string path = scratch + "/patches-file";
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0600);
+    CHECK(fd >= 0 && hsm_set_id(fd) > 0);
+    char id[HSM_ID_LENGTH + 1];
+    CHECK(hsm_get_id(fd, id, sizeof(id)) > 0);
+    string object = endpoint + "/" + id;
+
+    vector<uint8_t> data = random_data(5 * DELTA_BLOCK_SIZE + 1234);
+    rewrite(fd, data);
+    CHECK(sync.sync(target, fd, fd) == (ssize_t) data.size());
+
+    int patched = 0;
+    for (int edit = 0; edit < TEST_EDITS; edit++) {
+        size_t at = data.empty() ? 0 : (size_t) rand() % data.size();
+        switch (edit % 5) {
+            case 0: {
+                vector<uint8_t> added = random_data(1 + rand() % 5000);
+                data.insert(data.begin() + at, added.begin(), added.end());
+                break;
+            }
+            case 1:
+                data.erase(data.begin() + at, data.begin()
+                        + min(data.size(), at + 1 + rand() % 5000));
+                break;
+            case 2:
+                if (!data.empty())
+                    data[at] ^= 0x5a;
+                break;
+            case 3: {
+                vector<uint8_t> added = random_data(1 + rand() % 70000);
+                data.insert(data.end(), added.begin(), added.end());
+                break;
+            }
+            case 4:
+                data.resize(data.size() - min(data.size(),
+                        (size_t) rand() % 3000));
+                break;
+        }
+        rewrite(fd, data);
+        CHECK(sync.sync(target, fd, fd) >= 0);
+
+        vector<uint8_t> rebuilt;
+        int patches = rebuild(object, rebuilt);
+        CHECK(patches >= 0);
+        CHECK(rebuilt == data);
+        if (patches > 0)
+            patched++;
+    }
+    CHECK(patched > 0);
+
+    /* Only the bytes actually changed are counted. */
+    delta_stats before = sync.get_stats();
+    data[data.size() / 2] ^= 0xff;
+    rewrite(fd, data);
+    CHECK(sync.sync(target, fd, fd) >= 0);
+    delta_stats after = sync.get_stats();
+    CHECK(after.changed_bytes - before.changed_bytes <= DELTA_BLOCK_SIZE);
+    CHECK(after.total_bytes - before.total_bytes == data.size());
+    close(fd);
+}
+
+/**
+ * Once the object has been replaced by a full upload made elsewhere, the
+ * next upload is a full copy rather than a patch on top of the new object.
+ */
+static void test_etag_mismatch() {
+    string endpoint = scratch + "/etag";
+    string catalog = scratch + "/etag-catalog";
+    mkdir(endpoint.c_str(), 0700);
+    mkdir(catalog.c_str(), 0700);
+    s3 target("test", "");
+    target.set_endpoint(endpoint);
+    delta sync(catalog);
+
+    int fd = open((scratch + "/etag-file").c_str(), O_CREAT | O_TRUNC | O_RDWR,
+            0600);
+    CHECK(fd >= 0 && hsm_set_id(fd) > 0);
+    char id[HSM_ID_LENGTH + 1];
+    CHECK(hsm_get_id(fd, id, sizeof(id)) > 0);
+    string object = endpoint + "/" + id;
+
+    vector<uint8_t> data = random_data(4 * DELTA_BLOCK_SIZE);
+    rewrite(fd, data);
+    CHECK(sync.sync(target, fd, fd) == (ssize_t) data.size());
+
+    /* A small change is sent as a patch while the object is unchanged. */
+    data[10] ^= 0xff;
+    rewrite(fd, data);
+    ssize_t sent = sync.sync(target, fd, fd);
+    CHECK(sent > 0 && sent < (ssize_t) data.size());
+    vector<uint8_t> rebuilt;
+    CHECK(rebuild(object, rebuilt) == 1);
+    CHECK(rebuilt == data);
+
+    /* Another full upload, such as one made by a snapshot batch, replaces
+     * the object the signature was taken against. */
+    vector<uint8_t> other = random_data(data.size());
+    int copy = open((scratch + "/etag-other").c_str(),
+            O_CREAT | O_TRUNC | O_RDWR, 0600);
+    CHECK(copy >= 0 && write(copy, other.data(), other.size())
+            == (ssize_t) other.size());
+    CHECK(target.upload_file(fd, copy) == (ssize_t) other.size());
+    close(copy);
+
+    data[20] ^= 0xff;
+    rewrite(fd, data);
+    CHECK(sync.sync(target, fd, fd) == (ssize_t) data.size());
+    CHECK(rebuild(object, rebuilt) == 0);
+    CHECK(rebuilt == data);
+    close(fd);
+}
+
+/**
+ * Tests for delta sync and its block checksums, run against a local mock
+ * endpoint. The scratch directory must support user extended attributes and
+ * O_TMPFILE.
+ *
+ * @param argc
+ *     The number of arguments passed to the program.
+ *
+ * @param argv
+ *     The array of arguments passed to the program; the optional first
+ *     argument is the directory the scratch directory is created in.
+ *
+ * @return
+ *     Zero if every check passes; non-zero otherwise.
+ */
+int main(int argc, char** argv) {
+
+    string base = argc > 1 ? argv[1] : "/tmp";
+    vector<char> tmpl(base.begin(), base.end());
+    const char* name = "/cloudsm-test.XXXXXX";
+    tmpl.insert(tmpl.end(), name, name + strlen(name) + 1);
+    if (mkdtemp(tmpl.data()) == NULL) {
+        perror(tmpl.data());
+        return 1;
+    }
+    scratch = tmpl.data();
+
+    test_checksums();
+    test_patches();
+    test_etag_mismatch();
+
+    if (system(("rm -rf '" + scratch + "'").c_str()) != 0)
+        fprintf(stderr, "Unable to remove %s\n", scratch.c_str());
+    printf("%s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+
+}
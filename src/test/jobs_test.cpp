@@ -0,0 +1,268 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/jobs.h"
+
+#include <chrono>
+#include <signal.h>
+#include <stdio.h>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+/**
+ * The number of checks that have failed.
+ */
+static int failures = 0;
+
+/**
+ * Check that a condition holds, reporting it as a failure if it does not.
+ */
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, \
+                    __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/**
+ * The number of processes racing to claim the same file.
+ */
+#define TEST_RACERS 8
+
+/**
+ * The number of jobs that can be taken but not acknowledged at once, as set
+ * by JOBS_TAKEN_SIZE in jobs.cpp.
+ */
+#define TEST_TAKEN_SIZE 1024
+
+/**
+ * The device numbers of the job tables created by the tests.
+ */
+static vector<dev_t> devices;
+
+/**
+ * Returns a device number for a job table of its own, so that tests do not
+ * see each other's leases or jobs, nor those of a running monitor.
+ */
+static dev_t fresh_device() {
+    dev_t dev = ((dev_t) getpid() << 16) | (dev_t) (devices.size() + 1)
+            | ((dev_t) 0xc0de << 48);
+    devices.push_back(dev);
+    return dev;
+}
+
+/**
+ * Two threads of the same process cannot both hold a lease, and one cannot
+ * release the other's.
+ */
+static void test_threads() {
+    jobs table(fresh_device());
+    CHECK(table.is_attached());
+
+    CHECK(table.claim(42, JOB_UPLOAD, 60) == 1);
+    int claimed = -2;
+    int released = -2;
+    thread other([&]() {
+        claimed = table.claim(42, JOB_UPLOAD, 60);
+        released = table.release(42);
+    });
+    other.join();
+    CHECK(claimed == 0);
+    CHECK(released == -1);
+    CHECK(table.claim(42, JOB_UPLOAD, 60) == 1);
+    CHECK(table.release(42) == 0);
+}
+
+/**
+ * Of several processes claiming the same file at once, exactly one wins.
+ */
+static void test_race() {
+    dev_t dev = fresh_device();
+    jobs table(dev);
+    int start[2];
+    int results[2];
+    int done[2];
+    CHECK(pipe(start) == 0 && pipe(results) == 0 && pipe(done) == 0);
+
+    vector<pid_t> racers;
+    for (int i = 0; i < TEST_RACERS; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+
+            /* Hold the lease until every racer has tried, so that no racer
+             * can take over the lease of one that has already exited. */
+            jobs mine(dev);
+            char c;
+            close(start[1]);
+            close(done[1]);
+            if (read(start[0], &c, 1) != 0)
+                _exit(2);
+            char result = (char) mine.claim(7, JOB_UPLOAD, 60);
+            if (write(results[1], &result, 1) != 1 || read(done[0], &c, 1))
+                _exit(2);
+            _exit(0);
+        }
+        racers.push_back(pid);
+    }
+    close(start[0]);
+    close(start[1]);
+
+    int winners = 0;
+    int losers = 0;
+    for (int i = 0; i < TEST_RACERS; i++) {
+        char result;
+        if (read(results[0], &result, 1) != 1)
+            break;
+        if (result == 1)
+            winners++;
+        else if (result == 0)
+            losers++;
+    }
+    close(done[1]);
+    for (pid_t pid : racers)
+        waitpid(pid, NULL, 0);
+    close(results[0]);
+    close(results[1]);
+    close(done[0]);
+
+    CHECK(winners == 1);
+    CHECK(losers == TEST_RACERS - 1);
+}
+
+/**
+ * The lease of a process that is killed is taken over by the next claim,
+ * without waiting for it to expire.
+ */
+static void test_takeover() {
+    dev_t dev = fresh_device();
+    jobs table(dev);
+    int ready[2];
+    CHECK(pipe(ready) == 0);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        jobs mine(dev);
+        char result = (char) mine.claim(9, JOB_STUB, 600);
+        if (write(ready[1], &result, 1) != 1)
+            _exit(2);
+        pause();
+        _exit(0);
+    }
+    char result = 0;
+    CHECK(read(ready[0], &result, 1) == 1 && result == 1);
+    CHECK(table.claim(9, JOB_UPLOAD, 60) == 0);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    CHECK(table.claim(9, JOB_UPLOAD, 60) == 1);
+    CHECK(table.release(9) == 0);
+    close(ready[0]);
+    close(ready[1]);
+}
+
+/**
+ * A job taken by a process that exits without acknowledging it is put back
+ * on the queue by the next pop(), without anyone calling reap().
+ */
+static void test_requeue() {
+    dev_t dev = fresh_device();
+    jobs table(dev);
+    CHECK(table.push(11, JOB_UPLOAD) == 0);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        jobs mine(dev);
+        ino_t ino = 0;
+        int kind = 0;
+        _exit(mine.pop(&ino, &kind, 1000) == 1 && ino == 11 ? 0 : 1);
+    }
+    int status = -1;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    ino_t ino = 0;
+    int kind = 0;
+    CHECK(table.pop(&ino, &kind, 1000) == 1);
+    CHECK(ino == 11 && kind == JOB_UPLOAD);
+    CHECK(table.ack(ino) == 0);
+    CHECK(table.ack(ino) == -1);
+}
+
+/**
+ * A pop() waiting because too many jobs are taken returns as soon as one of
+ * them is acknowledged.
+ */
+static void test_ack_wakes() {
+    jobs table(fresh_device());
+    for (ino_t ino = 1; ino <= TEST_TAKEN_SIZE + 1; ino++)
+        CHECK(table.push(ino, JOB_UPLOAD) == 0);
+
+    ino_t ino;
+    int kind;
+    int taken = 0;
+    while (table.pop(&ino, &kind, 0) == 1)
+        taken++;
+    CHECK(taken == TEST_TAKEN_SIZE);
+
+    int popped = -2;
+    chrono::steady_clock::time_point woken;
+    thread waiter([&]() {
+        ino_t next;
+        int next_kind;
+        popped = table.pop(&next, &next_kind, 5000);
+        woken = chrono::steady_clock::now();
+    });
+    this_thread::sleep_for(chrono::milliseconds(50));
+    auto acked = chrono::steady_clock::now();
+    CHECK(table.ack(1) == 0);
+    waiter.join();
+    CHECK(popped == 1);
+    CHECK(woken - acked < chrono::milliseconds(500));
+}
+
+/**
+ * Tests for the shared job table, which run against tables of their own in
+ * POSIX shared memory.
+ *
+ * @return
+ *     Zero if every check passes; non-zero otherwise.
+ */
+int main() {
+
+    test_threads();
+    test_race();
+    test_takeover();
+    test_requeue();
+    test_ack_wakes();
+
+    /* Remove the tables, named as in jobs::jobs(). */
+    for (dev_t dev : devices) {
+        char name[128];
+        snprintf(name, sizeof(name), "/dev/shm/cloudsm.jobs.v3.%llx",
+                (unsigned long long) dev);
+        unlink(name);
+    }
+    printf("%s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+
+}
@@ -0,0 +1,360 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mock_s3.h"
+
+#include "common/s3.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * The lock guarding the endpoints and the uploads in progress.
+ */
+static mutex mock_lock;
+
+/**
+ * The behaviour of each endpoint, keyed by its directory.
+ */
+static map<string, unique_ptr<mock_endpoint>> endpoints;
+
+/**
+ * A multipart upload in progress.
+ */
+struct upload {
+
+    /**
+     * The file descriptor of the file the parts are written to.
+     */
+    int part_fd;
+
+    /**
+     * The number of parts uploaded so far.
+     */
+    int parts;
+
+};
+
+/**
+ * The multipart uploads in progress, keyed by the path of the object being
+ * uploaded.
+ */
+static map<string, upload> uploads;
+
+mock_endpoint& mock_s3(const string& endpoint) {
+    lock_guard<mutex> guard(mock_lock);
+    unique_ptr<mock_endpoint>& e = endpoints[endpoint];
+    if (!e)
+        e.reset(new mock_endpoint());
+    return *e;
+}
+
+/**
+ * Wait for a request to an endpoint to be answered, and decide whether it
+ * fails.
+ *
+ * @param e
+ *     The endpoint the request is sent to.
+ *
+ * @return
+ *     True if the request should fail with EIO; false otherwise.
+ */
+static bool request(mock_endpoint& e) {
+    if (e.delay_ms > 0)
+        this_thread::sleep_for(chrono::milliseconds(e.delay_ms));
+    long n = ++e.requests;
+    int rate = e.error_rate;
+    if (n * rate / 100 == (n - 1) * rate / 100)
+        return false;
+    errno = EIO;
+    return true;
+}
+
+/**
+ * Wait for data to be sent to or from an endpoint at its bandwidth. Every
+ * request to the endpoint shares the bandwidth, so that concurrent requests
+ * wait for each other.
+ *
+ * @param e
+ *     The endpoint the data is sent to or from.
+ *
+ * @param size
+ *     The number of bytes sent.
+ */
+static void transfer(mock_endpoint& e, size_t size) {
+    long rate = e.bandwidth;
+    if (rate <= 0 || size == 0)
+        return;
+    chrono::steady_clock::time_point done;
+    {
+        lock_guard<mutex> guard(mock_lock);
+        done = max(chrono::steady_clock::now(), e.link_free)
+                + chrono::nanoseconds((int64_t) (size * 1e9 / rate));
+        e.link_free = done;
+    }
+    this_thread::sleep_until(done);
+}
+
+/**
+ * Returns the path of an object within the directory of an endpoint.
+ *
+ * @param target
+ *     The S3 target holding the object.
+ *
+ * @param key
+ *     The key of the object.
+ *
+ * @return
+ *     The path of the object.
+ */
+static string key_path(s3& target, string key) {
+    for (char& c : key) {
+        if (c == '/')
+            c = '_';
+    }
+    return target.get_endpoint() + "/" + key;
+}
+
+/**
+ * Returns the path of the object for a file within the directory of an
+ * endpoint.
+ *
+ * @param target
+ *     The S3 target holding the object.
+ *
+ * @param fd
+ *     The file descriptor of the file whose object is stored.
+ *
+ * @return
+ *     The path of the object, or an empty string if it has no object key.
+ */
+static string object_path(s3& target, int fd) {
+    string key = target.get_object_key(fd);
+    if (key.empty())
+        return "";
+    return key_path(target, key);
+}
+
+int s3::upload_begin(int fd) {
+    string path = object_path(*this, fd);
+    if (path.empty())
+        return -1;
+    int part = open((path + ".part").c_str(), O_CREAT | O_TRUNC | O_RDWR,
+            0600);
+    if (part < 0)
+        return -1;
+    lock_guard<mutex> guard(mock_lock);
+    uploads[path] = { part, 0 };
+    return 0;
+}
+
+ssize_t s3::upload_part(int fd, const char* data, size_t size, off_t offset) {
+    mock_endpoint& e = mock_s3(this->endpoint);
+    int part;
+    {
+        lock_guard<mutex> guard(mock_lock);
+        auto upload = uploads.find(object_path(*this, fd));
+        if (upload == uploads.end() || e.fail_upload)
+            return -1;
+        part = upload->second.part_fd;
+    }
+    if (request(e))
+        return -1;
+    transfer(e, size);
+    ssize_t sent = pwrite(part, data, size, offset);
+    {
+        lock_guard<mutex> guard(mock_lock);
+        auto upload = uploads.find(object_path(*this, fd));
+        if (upload != uploads.end())
+            upload->second.parts++;
+    }
+    e.parts++;
+    if (e.on_part)
+        e.on_part();
+    return sent;
+}
+
+int s3::upload_end(int fd, bool commit) {
+    string path = object_path(*this, fd);
+    int part;
+    int parts;
+    {
+        lock_guard<mutex> guard(mock_lock);
+        auto upload = uploads.find(path);
+        if (upload == uploads.end())
+            return -1;
+        part = upload->second.part_fd;
+        parts = upload->second.parts;
+        uploads.erase(upload);
+    }
+    close(part);
+
+    /* As with S3, an upload cannot be completed without any parts. */
+    if (!commit || parts == 0) {
+        unlink((path + ".part").c_str());
+        return commit ? -1 : 0;
+    }
+    return rename((path + ".part").c_str(), path.c_str());
+}
+
+/**
+ * Copy the rest of a file, from its current position, into a new file.
+ *
+ * @param source
+ *     The file descriptor of the file being copied.
+ *
+ * @param path
+ *     The path of the file that receives the copy.
+ *
+ * @return
+ *     The number of bytes copied, or -1 if an error occurs.
+ */
+static ssize_t copy_to(int source, const string& path) {
+    int out = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (out < 0)
+        return -1;
+    vector<char> buf(1024 * 1024);
+    ssize_t total = 0;
+    ssize_t got;
+    while ((got = read(source, buf.data(), buf.size())) > 0) {
+        if (write(out, buf.data(), got) != got) {
+            got = -1;
+            break;
+        }
+        total += got;
+    }
+    if (close(out) != 0 || got < 0) {
+        unlink(path.c_str());
+        return -1;
+    }
+    return total;
+}
+
+ssize_t s3::upload_file(int fd, int source) {
+    mock_endpoint& e = mock_s3(this->endpoint);
+    string path = object_path(*this, fd);
+    if (path.empty() || e.fail_upload || request(e)
+            || lseek(source, 0, SEEK_SET) != 0)
+        return -1;
+    ssize_t sent = copy_to(source, path + ".part");
+    if (sent >= 0)
+        transfer(e, (size_t) sent);
+    if (sent < 0 || rename((path + ".part").c_str(), path.c_str()) != 0)
+        return -1;
+
+    /* A full copy replaces any patches uploaded on top of the last one. */
+    for (int seq = 1; unlink((path + ".patch." + to_string(seq)).c_str())
+            == 0; seq++)
+        ;
+    return sent;
+}
+
+int s3::upload_patch(int fd, int seq, int patch) {
+    mock_endpoint& e = mock_s3(this->endpoint);
+    string path = object_path(*this, fd);
+    if (path.empty() || e.fail_upload || request(e))
+        return -1;
+    ssize_t sent = copy_to(patch, path + ".patch." + to_string(seq));
+    if (sent > 0)
+        transfer(e, (size_t) sent);
+    return (int) sent;
+}
+
+string s3::get_etag(int fd) {
+    struct stat st;
+    string path = object_path(*this, fd);
+    if (path.empty() || stat(path.c_str(), &st) != 0)
+        return "";
+    return to_string(st.st_ino) + "-" + to_string(st.st_mtim.tv_sec) + "."
+            + to_string(st.st_mtim.tv_nsec);
+}
+
+ssize_t s3::download_file(int fd) {
+    mock_endpoint& e = mock_s3(this->endpoint);
+    if (request(e))
+        return -1;
+    int object = open(object_path(*this, fd).c_str(), O_RDONLY);
+    if (object < 0)
+        return -1;
+    off_t size = lseek(object, 0, SEEK_END);
+    if (size < 0 || ftruncate(fd, 0) != 0) {
+        close(object);
+        return -1;
+    }
+
+    /* Only the data regions of the object are copied, so that sparse
+     * objects of several gigabytes are cheap to recall. */
+    vector<char> buf(1024 * 1024);
+    bool failed = false;
+    off_t data = 0;
+    while (!failed && (data = lseek(object, data, SEEK_DATA)) >= 0) {
+        off_t hole = lseek(object, data, SEEK_HOLE);
+        while (data < hole) {
+            size_t want = (size_t) min<off_t>(hole - data, buf.size());
+            ssize_t got = pread(object, buf.data(), want, data);
+            if (got > 0)
+                transfer(e, (size_t) got);
+            if (got <= 0 || pwrite(fd, buf.data(), got, data) != got) {
+                failed = true;
+                break;
+            }
+            data += got;
+        }
+    }
+    close(object);
+    if (failed || ftruncate(fd, size) != 0)
+        return -1;
+    return (ssize_t) size;
+}
+
+int s3::rename_objects(vector<pair<string, string>>& keys,
+        vector<int>& results) {
+    int moved = 0;
+    results.clear();
+    for (auto& key : keys) {
+        if (rename(key_path(*this, key.first).c_str(),
+                key_path(*this, key.second).c_str()) == 0) {
+            results.push_back(0);
+            moved++;
+        }
+        else
+            results.push_back(errno);
+    }
+    return moved;
+}
+
+ssize_t s3::stat_object(int fd) {
+    mock_endpoint& e = mock_s3(this->endpoint);
+    e.stats++;
+    if (request(e))
+        return -1;
+    if (e.fail_stat) {
+        errno = EIO;
+        return -1;
+    }
+    struct stat st;
+    if (stat(object_path(*this, fd).c_str(), &st) != 0)
+        return -1;
+    return st.st_size;
+}
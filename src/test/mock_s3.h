@@ -0,0 +1,103 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MOCK_S3_H
+#define MOCK_S3_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+
+using namespace std;
+
+/**
+ * The behaviour of a mock S3 endpoint. The mock implements the s3 network
+ * operations against a local directory named by the endpoint of each target,
+ * so that code built on them can be tested without an object store.
+ */
+struct mock_endpoint {
+
+    /**
+     * The time, in milliseconds, that each request to the endpoint takes to
+     * answer, before any data is sent.
+     */
+    atomic<int> delay_ms{0};
+
+    /**
+     * The rate, in bytes per second, at which data is sent to and from the
+     * endpoint, shared by every request to it. Zero is unlimited.
+     */
+    atomic<long> bandwidth{0};
+
+    /**
+     * The percentage of parts, downloads and lookups that fail, spread
+     * evenly so that runs are repeatable.
+     */
+    atomic<int> error_rate{0};
+
+    /**
+     * Whether every part uploaded to the endpoint fails.
+     */
+    atomic<bool> fail_upload{false};
+
+    /**
+     * Whether every object lookup against the endpoint fails.
+     */
+    atomic<bool> fail_stat{false};
+
+    /**
+     * The number of parts uploaded to the endpoint.
+     */
+    atomic<int> parts{0};
+
+    /**
+     * The number of object lookups made against the endpoint.
+     */
+    atomic<int> stats{0};
+
+    /**
+     * The number of requests subject to error_rate made so far.
+     */
+    atomic<long> requests{0};
+
+    /**
+     * The time at which the data already sent will have been transferred at
+     * the configured bandwidth. Guarded by the lock of the mock.
+     */
+    chrono::steady_clock::time_point link_free;
+
+    /**
+     * A function called after each part is uploaded to the endpoint, if set.
+     */
+    function<void()> on_part;
+
+};
+
+/**
+ * Returns the behaviour of the mock endpoint stored in the given directory,
+ * creating it with the defaults on first use.
+ *
+ * @param endpoint
+ *     The directory the endpoint stores its objects in, as given to
+ *     s3::set_endpoint().
+ *
+ * @return
+ *     The behaviour of the endpoint.
+ */
+mock_endpoint& mock_s3(const string& endpoint);
+
+#endif /* MOCK_S3_H */
@@ -0,0 +1,369 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mock_s3.h"
+
+#include "common/replicas.h"
+#include "common/xattr.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * The number of checks that have failed.
+ */
+static int failures = 0;
+
+/**
+ * Check that a condition holds, reporting it as a failure if it does not.
+ */
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, \
+                    __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/**
+ * The size, in bytes, of the file replicated by the tests, chosen so that it
+ * is sent in three parts.
+ */
+#define TEST_FILE_SIZE (2 * REPLICA_CHUNK_SIZE + 4096)
+
+/**
+ * The scratch directory the tests run in.
+ */
+static string scratch;
+
+/**
+ * Create a mock endpoint directory in the scratch directory, and a target
+ * that stores its objects there.
+ *
+ * @param name
+ *     The name of the endpoint.
+ *
+ * @return
+ *     The target for the endpoint.
+ */
+static s3 make_target(const string& name) {
+    string dir = scratch + "/" + name;
+    mkdir(dir.c_str(), 0700);
+    s3 target("test", "");
+    target.set_endpoint(dir);
+    return target;
+}
+
+/**
+ * Create a dirty file of random data, with an object ID, in the scratch
+ * directory.
+ *
+ * @param name
+ *     The name of the file.
+ *
+ * @param data
+ *     The vector that receives the contents of the file.
+ *
+ * @return
+ *     The file descriptor of the file, opened for reading and writing.
+ */
+static int make_file(const string& name, vector<char>& data) {
+    data.resize(TEST_FILE_SIZE);
+    for (char& c : data)
+        c = (char) rand();
+    int fd = open((scratch + "/" + name).c_str(),
+            O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (fd < 0 || write(fd, data.data(), data.size())
+            != (ssize_t) data.size()) {
+        perror(name.c_str());
+        exit(1);
+    }
+    hsm_set_id(fd);
+    hsm_mark_dirty(fd);
+    return fd;
+}
+
+/**
+ * Returns whether the object stored for a file on an endpoint holds the given
+ * data.
+ */
+static bool holds(s3& target, int fd, const vector<char>& data) {
+    char id[HSM_ID_LENGTH + 1];
+    if (hsm_get_id(fd, id, sizeof(id)) < 0)
+        return false;
+    FILE* object = fopen((target.get_endpoint() + "/" + id).c_str(), "r");
+    if (object == NULL)
+        return false;
+    vector<char> stored(data.size() + 1);
+    size_t got = fread(stored.data(), 1, stored.size(), object);
+    fclose(object);
+    return got == data.size() && memcmp(stored.data(), data.data(), got) == 0;
+}
+
+/**
+ * Each file is read once and sent to every replica, and a file that every
+ * replica already holds is not sent again.
+ */
+static void test_upload() {
+    s3 a = make_target("upload-a");
+    s3 b = make_target("upload-b");
+    replicas set({ a, b });
+    vector<char> data;
+    int fd = make_file("upload", data);
+    uint64_t gen = hsm_get_generation(fd);
+
+    CHECK(set.upload_file(fd, fd, gen) == TEST_FILE_SIZE);
+    CHECK(holds(a, fd, data));
+    CHECK(holds(b, fd, data));
+    CHECK(mock_s3(a.get_endpoint()).parts == 3);
+    CHECK(mock_s3(b.get_endpoint()).parts == 3);
+    CHECK(hsm_get_replicas(fd, gen) == 3);
+
+    CHECK(set.upload_file(fd, fd, gen) == TEST_FILE_SIZE);
+    CHECK(mock_s3(a.get_endpoint()).parts == 3);
+    CHECK(mock_s3(b.get_endpoint()).parts == 3);
+    close(fd);
+}
+
+/**
+ * An empty file is sent as a single empty part, so that the upload can be
+ * completed.
+ */
+static void test_empty_upload() {
+    s3 a = make_target("empty-a");
+    replicas set({ a });
+    int fd = open((scratch + "/empty").c_str(), O_CREAT | O_TRUNC | O_RDWR,
+            0600);
+    CHECK(fd >= 0 && hsm_set_id(fd) > 0);
+    uint64_t gen = hsm_get_generation(fd);
+
+    CHECK(set.upload_file(fd, fd, gen) == 0);
+    CHECK(mock_s3(a.get_endpoint()).parts == 1);
+    CHECK(holds(a, fd, vector<char>()));
+    CHECK(hsm_get_replicas(fd, gen) == 1);
+    close(fd);
+}
+
+/**
+ * A write made while a file is being uploaded leaves every replica out of
+ * date, so that the next upload sends the file again.
+ */
+static void test_write_during_upload() {
+    s3 a = make_target("write-a");
+    s3 b = make_target("write-b");
+    replicas set({ a, b });
+    vector<char> data;
+    int fd = make_file("write", data);
+    uint64_t gen = hsm_get_generation(fd);
+
+    mock_endpoint& e = mock_s3(a.get_endpoint());
+    e.on_part = [&]() {
+        e.on_part = nullptr;
+        hsm_mark_dirty(fd);
+    };
+    CHECK(set.upload_file(fd, fd, gen) < 0);
+    uint64_t next = hsm_get_generation(fd);
+    CHECK(next != gen);
+    CHECK(hsm_get_replicas(fd, gen) == 0);
+    CHECK(hsm_get_replicas(fd, next) == 0);
+
+    CHECK(set.upload_file(fd, fd, next) == TEST_FILE_SIZE);
+    CHECK(mock_s3(a.get_endpoint()).parts == 6);
+    CHECK(mock_s3(b.get_endpoint()).parts == 6);
+    CHECK(hsm_get_replicas(fd, next) == 3);
+    close(fd);
+}
+
+/**
+ * Giving a file a new object ID while it is being uploaded under its old one
+ * leaves it dirty, with no replica marked current. Its first object ID does
+ * not move the write generation on, so the first upload is not repeated.
+ */
+static void test_rekey_during_upload() {
+    s3 a = make_target("rekey-a");
+    replicas set({ a });
+    int fd = open((scratch + "/rekey").c_str(), O_CREAT | O_TRUNC | O_RDWR,
+            0600);
+    CHECK(fd >= 0 && write(fd, "rekey", 5) == 5);
+    uint64_t gen = hsm_get_generation(fd);
+    CHECK(hsm_set_id(fd) > 0);
+    CHECK(hsm_get_generation(fd) == gen);
+    CHECK(hsm_is_dirty(fd));
+
+    mock_endpoint& e = mock_s3(a.get_endpoint());
+    e.on_part = [&]() {
+        e.on_part = nullptr;
+        hsm_set_id(fd);
+    };
+    CHECK(set.upload_file(fd, fd, gen) < 0);
+    CHECK(hsm_get_generation(fd) != gen);
+    CHECK(hsm_clear_dirty_gen(fd, gen) == 0);
+    CHECK(hsm_is_dirty(fd));
+    CHECK(hsm_get_replicas(fd, hsm_get_generation(fd)) == 0);
+    close(fd);
+}
+
+/**
+ * A failed upload is only retried against the replicas that missed it.
+ */
+static void test_retry() {
+    s3 a = make_target("retry-a");
+    s3 b = make_target("retry-b");
+    replicas set({ a, b });
+    vector<char> data;
+    int fd = make_file("retry", data);
+    uint64_t gen = hsm_get_generation(fd);
+
+    mock_s3(b.get_endpoint()).fail_upload = true;
+    CHECK(set.upload_file(fd, fd, gen) < 0);
+    CHECK(hsm_get_replicas(fd, gen) == 1);
+    CHECK(holds(a, fd, data));
+    CHECK(!holds(b, fd, data));
+
+    mock_s3(b.get_endpoint()).fail_upload = false;
+    int sent = mock_s3(a.get_endpoint()).parts;
+    CHECK(set.upload_file(fd, fd, gen) == TEST_FILE_SIZE);
+    CHECK(mock_s3(a.get_endpoint()).parts == sent);
+    CHECK(holds(b, fd, data));
+    CHECK(hsm_get_replicas(fd, gen) == 3);
+    close(fd);
+}
+
+/**
+ * A recall is served by the replica that answers first, and does not wait
+ * for the lookup sent to a slower replica to finish.
+ */
+static void test_hedged_recall() {
+    s3 slow = make_target("hedge-slow");
+    s3 fast = make_target("hedge-fast");
+    replicas set({ slow, fast });
+    vector<char> data;
+    int fd = make_file("hedge", data);
+    CHECK(set.upload_file(fd, fd, hsm_get_generation(fd)) == TEST_FILE_SIZE);
+    CHECK(ftruncate(fd, 0) == 0);
+
+    mock_s3(slow.get_endpoint()).delay_ms = 1000;
+    auto start = chrono::steady_clock::now();
+    CHECK(set.download_file(fd) == TEST_FILE_SIZE);
+    auto elapsed = chrono::steady_clock::now() - start;
+    CHECK(elapsed < chrono::milliseconds(500));
+    CHECK(mock_s3(fast.get_endpoint()).stats == 1);
+
+    vector<char> recalled(data.size());
+    CHECK(pread(fd, recalled.data(), recalled.size(), 0)
+            == (ssize_t) recalled.size());
+    CHECK(recalled == data);
+    close(fd);
+}
+
+/**
+ * A recall of a file larger than 2 GiB reports its full size, rather than
+ * being taken for a failure.
+ */
+static void test_large_recall() {
+    s3 a = make_target("large-a");
+    replicas set({ a });
+    int fd = open((scratch + "/large").c_str(), O_CREAT | O_TRUNC | O_RDWR,
+            0600);
+    CHECK(fd >= 0 && hsm_set_id(fd) > 0);
+    char id[HSM_ID_LENGTH + 1];
+    CHECK(hsm_get_id(fd, id, sizeof(id)) > 0);
+
+    /* A sparse object with a marker at its end. */
+    const off_t size = 3ll * 1024 * 1024 * 1024;
+    int object = open((a.get_endpoint() + "/" + id).c_str(),
+            O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    CHECK(object >= 0 && ftruncate(object, size) == 0);
+    CHECK(pwrite(object, "tail", 4, size - 4) == 4);
+    close(object);
+
+    CHECK(set.download_file(fd) == (ssize_t) size);
+    char tail[4];
+    CHECK(pread(fd, tail, sizeof(tail), size - 4) == 4);
+    CHECK(memcmp(tail, "tail", 4) == 0);
+    close(fd);
+}
+
+/**
+ * A replica that fails to answer is moved to the back of the order, rather
+ * than being tried first on every recall.
+ */
+static void test_failure_penalty() {
+    s3 broken = make_target("penalty-broken");
+    s3 good = make_target("penalty-good");
+    replicas set({ broken, good });
+    vector<char> data;
+    int fd = make_file("penalty", data);
+    CHECK(set.upload_file(fd, fd, hsm_get_generation(fd)) == TEST_FILE_SIZE);
+
+    mock_s3(broken.get_endpoint()).fail_stat = true;
+    CHECK(set.download_file(fd) == TEST_FILE_SIZE);
+    CHECK(mock_s3(broken.get_endpoint()).stats == 1);
+    CHECK(set.download_file(fd) == TEST_FILE_SIZE);
+    CHECK(set.download_file(fd) == TEST_FILE_SIZE);
+    CHECK(mock_s3(broken.get_endpoint()).stats == 1);
+    CHECK(mock_s3(good.get_endpoint()).stats == 3);
+    close(fd);
+}
+
+/**
+ * Tests for replicating files to several S3 targets, run against local mock
+ * endpoints. The scratch directory must support user extended attributes.
+ *
+ * @param argc
+ *     The number of arguments passed to the program.
+ *
+ * @param argv
+ *     The array of arguments passed to the program; the optional first
+ *     argument is the directory the scratch directory is created in.
+ *
+ * @return
+ *     Zero if every check passes; non-zero otherwise.
+ */
+int main(int argc, char** argv) {
+
+    string base = argc > 1 ? argv[1] : "/tmp";
+    vector<char> tmpl(base.begin(), base.end());
+    const char* name = "/cloudsm-test.XXXXXX";
+    tmpl.insert(tmpl.end(), name, name + strlen(name) + 1);
+    if (mkdtemp(tmpl.data()) == NULL) {
+        perror(tmpl.data());
+        return 1;
+    }
+    scratch = tmpl.data();
+
+    test_upload();
+    test_empty_upload();
+    test_write_during_upload();
+    test_rekey_during_upload();
+    test_retry();
+    test_hedged_recall();
+    test_large_recall();
+    test_failure_penalty();
+
+    if (system(("rm -rf '" + scratch + "'").c_str()) != 0)
+        fprintf(stderr, "Unable to remove %s\n", scratch.c_str());
+    printf("%s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright 2020 OS3 LLC.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mock_s3.h"
+
+#include "common/s3.h"
+#include "common/xattr.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * The number of checks that have failed.
+ */
+static int failures = 0;
+
+/**
+ * Check that a condition holds, reporting it as a failure if it does not.
+ */
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, \
+                    __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/**
+ * The scratch directory the tests run in.
+ */
+static string scratch;
+
+/**
+ * Create a mock endpoint directory in the scratch directory, and a target
+ * that stores its objects there.
+ *
+ * @param name
+ *     The name of the endpoint.
+ *
+ * @return
+ *     The target for the endpoint.
+ */
+static s3 make_target(const string& name) {
+    string dir = scratch + "/" + name;
+    mkdir(dir.c_str(), 0700);
+    s3 target("test", "");
+    target.set_endpoint(dir);
+    return target;
+}
+
+/**
+ * Create a file in the scratch directory holding the given data.
+ *
+ * @param name
+ *     The name of the file.
+ *
+ * @param data
+ *     The contents of the file.
+ *
+ * @return
+ *     The file descriptor of the file, opened for reading and writing.
+ */
+static int make_file(const string& name, const string& data) {
+    int fd = open((scratch + "/" + name).c_str(), O_CREAT | O_TRUNC | O_RDWR,
+            0600);
+    if (fd < 0 || write(fd, data.data(), data.size())
+            != (ssize_t) data.size()) {
+        perror(name.c_str());
+        exit(1);
+    }
+    return fd;
+}
+
+/**
+ * Store an object in a mock endpoint under the given key.
+ *
+ * @param target
+ *     The target of the endpoint.
+ *
+ * @param key
+ *     The key of the object.
+ *
+ * @param data
+ *     The contents of the object.
+ */
+static void put_object(s3& target, string key, const string& data) {
+    for (char& c : key) {
+        if (c == '/')
+            c = '_';
+    }
+    FILE* object = fopen((target.get_endpoint() + "/" + key).c_str(), "w");
+    CHECK(object != NULL);
+    if (object == NULL)
+        return;
+    CHECK(fwrite(data.data(), 1, data.size(), object) == data.size());
+    fclose(object);
+}
+
+/**
+ * Returns the contents of the object stored for a file, or an empty string
+ * if there is none.
+ */
+static string get_object(s3& target, int fd) {
+    char id[HSM_ID_LENGTH + 1];
+    if (hsm_get_id(fd, id, sizeof(id)) < 0)
+        return "";
+    FILE* object = fopen((target.get_endpoint() + "/" + id).c_str(), "r");
+    if (object == NULL)
+        return "";
+    char buf[256];
+    size_t got = fread(buf, 1, sizeof(buf), object);
+    fclose(object);
+    return string(buf, got);
+}
+
+/**
+ * A new file is given an object ID, and is dirty until it is uploaded.
+ */
+static void test_new_file() {
+    s3 target = make_target("new");
+    int fd = make_file("new-file", "new");
+    CHECK(!hsm_is_legacy(fd));
+
+    string key = target.get_object_key(fd);
+    char id[HSM_ID_LENGTH + 1];
+    CHECK(hsm_get_id(fd, id, sizeof(id)) == HSM_ID_LENGTH);
+    CHECK(key == id);
+    CHECK(hsm_is_dirty(fd));
+    close(fd);
+}
+
+/**
+ * A clean file uploaded before object IDs keeps its path-based key without
+ * being marked dirty, and is then moved to an object ID without anything
+ * being uploaded again.
+ */
+static void test_clean_migration() {
+    s3 target = make_target("clean");
+    int fd = make_file("clean-file", "legacy contents");
+    hsm_clear_dirty(fd);
+    uint64_t gen = hsm_get_generation(fd);
+    CHECK(hsm_is_legacy(fd));
+
+    string path = scratch + "/clean-file";
+    string key = target.get_object_key(fd);
+    CHECK(key == path.substr(1));
+    CHECK(!hsm_is_dirty(fd));
+    char id[HSM_ID_LENGTH + 1];
+    CHECK(hsm_get_id(fd, id, sizeof(id)) < 0);
+
+    put_object(target, key, "legacy contents");
+    vector<int> fds = { fd };
+    CHECK(target.migrate_files(fds) == 1);
+    CHECK(!hsm_is_legacy(fd));
+    CHECK(!hsm_is_dirty(fd));
+    CHECK(hsm_get_generation(fd) == gen);
+    CHECK(get_object(target, fd) == "legacy contents");
+    CHECK(target.get_object_key(fd) != key);
+
+    /* A file already migrated is left alone. */
+    CHECK(target.migrate_files(fds) == 0);
+    close(fd);
+}
+
+/**
+ * A legacy stub is migrated the same way, and a file whose path-based object
+ * cannot be moved keeps its path-based key rather than an ID with nothing
+ * behind it.
+ */
+static void test_stub_migration() {
+    s3 target = make_target("stub");
+    int stub = make_file("stub-file", "");
+    hsm_mark_stub(stub);
+    int missing = make_file("missing-file", "lost");
+    hsm_clear_dirty(missing);
+
+    put_object(target, target.get_object_key(stub), "stubbed contents");
+    vector<int> fds = { stub, missing };
+    CHECK(target.migrate_files(fds) == 1);
+    CHECK(get_object(target, stub) == "stubbed contents");
+    CHECK(hsm_is_legacy(missing));
+    CHECK(target.get_object_key(missing)
+            == (scratch + "/missing-file").substr(1));
+    close(stub);
+    close(missing);
+}
+
+/**
+ * Tests for object keys and the migration of objects stored before object
+ * IDs, run against a local mock endpoint. The scratch directory must support
+ * user extended attributes.
+ *
+ * @param argc
+ *     The number of arguments passed to the program.
+ *
+ * @param argv
+ *     The array of arguments passed to the program; the optional first
+ *     argument is the directory the scratch directory is created in.
+ *
+ * @return
+ *     Zero if every check passes; non-zero otherwise.
+ */
+int main(int argc, char** argv) {
+
+    string base = argc > 1 ? argv[1] : "/tmp";
+    vector<char> tmpl(base.begin(), base.end());
+    const char* name = "/cloudsm-test.XXXXXX";
+    tmpl.insert(tmpl.end(), name, name + strlen(name) + 1);
+    if (mkdtemp(tmpl.data()) == NULL) {
+        perror(tmpl.data());
+        return 1;
+    }
+    scratch = tmpl.data();
+
+    test_new_file();
+    test_clean_migration();
+    test_stub_migration();
+
+    if (system(("rm -rf '" + scratch + "'").c_str()) != 0)
+        fprintf(stderr, "Unable to remove %s\n", scratch.c_str());
+    printf("%s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+
+}